@@ -9,11 +9,16 @@
 #include <stdlib.h>
 #include <sys/types.h>  // for pid_t and etc
 #include <sys/time.h>   // for gettimeofday
+#include <pthread.h>    // for pthread_key_t
+#include <errno.h>
 #if  __linux__
 #   include <sys/syscall.h>
 #endif
 #include <cassert>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #include <turf/Atomic.h>
 
@@ -29,6 +34,9 @@
 #include "helper.hpp"
 #include "concurrency.hpp"
 #include "queue.hpp"
+#include "pool.hpp"
+#include "deferred.hpp"
+#include "shm_stats.hpp"
 
 
 // TODO: signal handler
@@ -56,12 +64,230 @@ namespace tz { namespace asynclog {
         MSGTYPE_FLUSH,
     };
 
+    enum MsgFlag {
+        MSGFLAG_DEFERRED = 1,   // msg_data holds serialized printf args, see deferred.hpp
+        MSGFLAG_LITERAL  = 2,   // no payload, the msg is site->fmt
+        MSGFLAG_MORE     = 4,   // payload continues in the next chunk from the same thread
+        MSGFLAG_CONT     = 8,   // continuation chunk, joined by consumer before sink
+        MSGFLAG_HEAP     = 16,  // malloc()ed, e.g. joined by consumer or priority msg of QUEUE_RING
+        MSGFLAG_BUDGET   = 32,  // counted in Stats::inflight_bytes until recycled
+    };
+
+    enum QueueMode {
+        QUEUE_MPMC = 0,     // one shared queue for all producers
+        QUEUE_SPSC,         // one ring per producer thread, drained round-robin
+        QUEUE_RING,         // msgs stored inline in one byte ring, no allocation
+    };
+
+    enum WaitMode {
+        WAIT_SLEEP = 0,     // idle consumer spins, yields, then polls with growing sleeps
+        WAIT_PARK,          // idle consumer blocks until a producer wakes it
+    };
+
+    // how producers stamp msgs
+    enum ClockSource {
+        CLOCKSRC_REALTIME = 0,      // clock_gettime(CLOCK_REALTIME) per msg
+        CLOCKSRC_COARSE,            // CLOCK_REALTIME_COARSE, resolution of a jiffy
+        CLOCKSRC_TSC,               // rdtsc per msg, converted to wall time by consumer. needs invariant tsc.
+        CLOCKSRC_TICKER,            // time cached by a ticker thread every ticker_interval_us
+    };
+
+    // what a producer does when the queue is full
+    enum OverflowPolicy {
+        OVERFLOW_DROP = 0,          // drop the msg
+        OVERFLOW_BLOCK,             // wait until there is room
+        OVERFLOW_BLOCK_TIMEOUT,     // wait up to overflow_timeout_ms, then drop
+    };
+
+    // load shedding step, set by consumer from queue occupancy
+    enum Pressure {
+        PRESSURE_NONE = 0,
+        PRESSURE_SAMPLE,            // keep 1 in shed_sample_every msgs at or below shed_sample_level
+        PRESSURE_SHED,              // reject msgs at or below shed_drop_level
+    };
+
+#define TZ_ASYNCLOG_SHED_SHARDS 16  // power of 2
+
+    // msgs shed by the threads with tid % TZ_ASYNCLOG_SHED_SHARDS, one cache line each
+    struct _ShedShard {
+        turf::Atomic<uint64_t> n;
+        char _pad[64 - sizeof(uint64_t)];
+
+        _ShedShard() : n(0) {}
+    };
+
+    struct _LogSiteState;
+    struct _SiteShard;
+
+    // static descriptor of a TZ_ASYNC_LOG call site, constant initialized and registered on first hit
+    struct LogSite {
+        const char      *fmt;       // NULL unless fmt is a const char array, e.g. a literal
+        const char      *file;
+        int             line;
+        const char      *func;
+        LevelType       level;
+        _LogSiteState   *state;     // set by _register_site()
+        LogSite         *next;      // registry link, immutable after publish
+    };
+
+    // per site data that can not be constant initialized
+    struct _LogSiteState {
+        turf::Atomic<_FmtPlan *> plan;     // parsed fmt for deferred formatting, built on first use
+        bool literal;                       // fmt has no conversion spec, may be logged as is
+        size_t literal_size;                // strlen(fmt) if literal, else 0
+        turf::Atomic<uint32_t> size_hint;   // formatted size seen before, to size the msg
+        turf::Atomic<_SiteShard *> shards;  // TZ_ASYNCLOG_SITE_SHARDS counters, made on first count
+
+        _LogSiteState() : plan(NULL), literal(false), literal_size(0), size_hint(0), shards(NULL) {}
+    };
+
+#define TZ_ASYNCLOG_SITE_SHARDS 16  // power of 2
+
+    // counters of a site for the threads with tid % TZ_ASYNCLOG_SITE_SHARDS, one cache line each.
+    // allocated with _new_aligned() so a shard never straddles two lines.
+    struct _SiteShard {
+        turf::Atomic<uint64_t> hits;
+        turf::Atomic<uint64_t> bytes;
+        turf::Atomic<uint64_t> drops;
+        char _pad[64 - 3 * sizeof(uint64_t)];
+
+        _SiteShard() : hits(0), bytes(0), drops(0) {}
+    };
+
+    // counters of a site summed over shards
+    struct LogSiteStats {
+        const LogSite *site;
+        uint64_t hits;      // calls that passed should_log(), chunks not counted
+        uint64_t bytes;     // payload of queued msgs, args size for deferred msgs, fmt size for literals
+        uint64_t drops;
+    };
+
+    struct _LogSiteRegistry {
+        turf::Atomic<LogSite *> head;
+
+        _LogSiteRegistry() : head(NULL) {}
+    };
+
+    inline _LogSiteRegistry &_get_site_registry() {
+        static _LogSiteRegistry registry;   // function static, safe to use during static init
+        return registry;
+    }
+
+    inline bool _register_site(LogSite *site) {
+        site->state = new _LogSiteState();
+        site->state->literal = site->fmt != NULL && ::strchr(site->fmt, '%') == NULL;
+        site->state->literal_size = site->state->literal ? ::strlen(site->fmt) : 0;
+        _LogSiteRegistry &registry = _get_site_registry();
+        LogSite *head = registry.head.load(turf::Relaxed);
+        do {
+            site->next = head;
+        } while (!registry.head.compareExchangeWeak(head, site, turf::Release, turf::Relaxed));
+        return true;
+    }
+
+    // all sites hit so far, newest first
+    inline LogSite *get_log_sites() {
+        return _get_site_registry().head.load(turf::Acquire);
+    }
+
+    // cached plan of fmt for site, NULL if site is NULL or fmt is not the site's fmt
+    inline _FmtPlan *_get_site_plan(const LogSite *site, const char *fmt) {
+        if (site == NULL || site->fmt != fmt) {
+            return NULL;
+        }
+        _FmtPlan *plan = site->state->plan.load(turf::Acquire);
+        if (plan == NULL) {
+            _FmtPlan *fresh = _make_fmt_plan(fmt);
+            plan = site->state->plan.compareExchange(NULL, fresh, turf::AcquireRelease);
+            if (plan == NULL) {
+                plan = fresh;
+            } else {
+                delete fresh;   // built by another thread
+            }
+        }
+        return plan;
+    }
+
+    inline void _count_site(const LogSite *site, pid_t tid, uint64_t hits, uint64_t bytes, uint64_t drops) {
+        _SiteShard *shards = site->state->shards.load(turf::Acquire);
+        if (shards == NULL) {
+            _SiteShard *fresh = _new_aligned<_SiteShard>(TZ_ASYNCLOG_SITE_SHARDS);
+            shards = site->state->shards.compareExchange(NULL, fresh, turf::AcquireRelease);
+            if (shards == NULL) {
+                shards = fresh;
+            } else {
+                _delete_aligned(fresh, TZ_ASYNCLOG_SITE_SHARDS);     // made by another thread
+            }
+        }
+        _SiteShard &shard = shards[(uint32_t)tid & (TZ_ASYNCLOG_SITE_SHARDS - 1)];
+        if (hits != 0) {
+            shard.hits.fetchAdd(hits, turf::Relaxed);
+        }
+        if (bytes != 0) {
+            shard.bytes.fetchAdd(bytes, turf::Relaxed);
+        }
+        if (drops != 0) {
+            shard.drops.fetchAdd(drops, turf::Relaxed);
+        }
+    }
+
+    // counted sites, see AsyncLogger::set_site_stats(). counters live in the site and are process
+    // wide: a site logged to several loggers with site stats on sums all of them.
+    inline void get_log_site_stats(std::vector<LogSiteStats> &out) {
+        out.clear();
+        for (const LogSite *site = get_log_sites(); site != NULL; site = site->next) {
+            _SiteShard *shards = site->state->shards.load(turf::Acquire);
+            if (shards == NULL) {
+                continue;
+            }
+            LogSiteStats st = {site, 0, 0, 0};
+            for (size_t i = 0; i < TZ_ASYNCLOG_SITE_SHARDS; ++i) {
+                st.hits += shards[i].hits.load(turf::Relaxed);
+                st.bytes += shards[i].bytes.load(turf::Relaxed);
+                st.drops += shards[i].drops.load(turf::Relaxed);
+            }
+            out.push_back(st);
+        }
+    }
+
+    inline bool _site_louder(const LogSiteStats &a, const LogSiteStats &b) {
+        if (a.bytes != b.bytes) {
+            return a.bytes > b.bytes;
+        }
+        return a.hits > b.hits;
+    }
+
+    // keeps the top_n sites by bytes, then hits
+    inline void _top_log_sites(std::vector<LogSiteStats> &sites, size_t top_n) {
+        if (sites.size() > top_n) {
+            std::partial_sort(sites.begin(), sites.begin() + top_n, sites.end(), _site_louder);
+            sites.resize(top_n);
+        } else {
+            std::sort(sites.begin(), sites.end(), _site_louder);
+        }
+    }
+
+    inline void dump_log_sites(FILE *fp, size_t top_n) {
+        std::vector<LogSiteStats> sites;
+        get_log_site_stats(sites);
+        _top_log_sites(sites, top_n);
+        fprintf(fp, "%12s %14s %10s  %s\n", "HITS", "BYTES", "DROPS", "SITE");
+        for (size_t i = 0; i < sites.size(); ++i) {
+            const LogSiteStats &st = sites[i];
+            fprintf(fp, "%12lu %14lu %10lu  %s:%d %s\n", (unsigned long)st.hits, (unsigned long)st.bytes,
+                (unsigned long)st.drops, st.site->file, st.site->line, st.site->func);
+        }
+    }
+
     struct LogMsg {
         uint8_t         type;   // MsgType
         LevelType       level;
-        struct timeval  time;
+        uint8_t         flags;  // MsgFlag
+        uint64_t        time_ns;    // wall clock since epoch. raw tsc with CLOCKSRC_TSC until consumer converts it
+        uint64_t        mono_ns;    // CLOCK_MONOTONIC if monotonic_stamp is set, else 0
         pid_t           tid;
-        // TODO: source, lineno and etc
+        const LogSite   *site;  // NULL if not logged by TZ_ASYNC_LOG
+        uint64_t        seq;    // per logger, in call order. 0 for control msgs.
         size_t          msg_size;
         char            msg_data[0];
     };
@@ -76,10 +302,26 @@ namespace tz { namespace asynclog {
         ILogSink() : logger(NULL) {}
         virtual ~ILogSink() {}
         virtual bool sink(LogMsg *msg) = 0;
+        // msgs are all MSGTYPE_LOG and moved to sink like sink()
+        virtual bool sink_batch(LogMsg **msgs, size_t n) {
+            bool ok = true;
+            for (size_t i = 0; i < n; ++i) {
+                ok = this->sink(msgs[i]) && ok;
+            }
+            return ok;
+        }
         virtual void flush() = 0;
         virtual void close() = 0;
     };
 
+    // called on the consumer thread, see AsyncLogger::set_metrics_exporter()
+    struct IMetricsExporter {
+        typedef TZ_ASYNCLOG_SHARED_PTR<IMetricsExporter> Ptr;
+
+        virtual ~IMetricsExporter() {}
+        virtual void export_metrics(AsyncLogger &logger) = 0;
+    };
+
     struct IFormatter {
         typedef TZ_ASYNCLOG_SHARED_PTR<IFormatter> Ptr;
 
@@ -87,15 +329,177 @@ namespace tz { namespace asynclog {
         virtual void format(std::string &buf, LogMsg *msg) = 0;
     };
 
+    // consumer only, a long msg being joined from chunks. a thread may have one per lane,
+    // the priority lane is popped ahead of chunks still in the regular queue.
+    struct _Chunked {
+        pid_t   tid;
+        bool    prio;   // came through the priority lane
+        LogMsg  *msg;   // MSGFLAG_HEAP
+        size_t  cap;
+        uint64_t since_ms;  // first chunk seen
+    };
+
+    // consumer only, last msg of a thread and how often it was repeated since
+    struct _Repeat {
+        pid_t       tid;    // 0 if unused
+        LevelType   level;
+        uint8_t     flags;
+        const LogSite *site;
+        uint64_t    hash;
+        std::string data;   // payload of the last msg, a hash match is checked against it
+        uint32_t    count;
+        uint64_t    first_ns;   // time of the first repeat
+        uint64_t    last_ns;    // time of the last repeat
+        uint64_t    seq;        // of the last repeat
+    };
+
+    // shared queue of QUEUE_MPMC. replaced on resize, the old one is drained and kept until destruction.
+    struct _LogQueue {
+        MPMCBoundedQueue<LogMsg *> q;
+        _LogQueue *retired_next;    // set before publish to retired_queues
+
+        explicit _LogQueue(size_t size)
+            : q(size), retired_next(NULL)
+        {}
+    };
+
+    // per thread ring used by QUEUE_SPSC
+    struct _ThreadQueue {
+        SPSCBoundedQueue<LogMsg *> q;
+        turf::Atomic<uint8_t> closed;   // set on thread exit
+        _ThreadQueue *next;             // set before publish, then touched by consumer only
+        size_t stop_left;               // consumer only, msgs still to take after STOP
+
+        explicit _ThreadQueue(size_t size)
+            : q(size), closed(0), next(NULL), stop_left(0)
+        {}
+    };
+
+    // log-linear histogram of ns, 4 buckets per power of 2
+#define TZ_ASYNCLOG_LATENCY_BUCKETS 252
+
+    inline size_t _latency_bucket(uint64_t ns) {
+        if (ns < 4) {
+            return (size_t)ns;
+        }
+        size_t msb = 63 - (size_t)__builtin_clzll(ns);
+        return ((msb - 1) << 2) + (size_t)((ns >> (msb - 2)) & 3);
+    }
+
+    // exclusive upper bound of bucket idx in ns
+    inline uint64_t latency_bucket_upper(size_t idx) {
+        if (idx < 4) {
+            return idx + 1;
+        }
+        size_t msb = (idx >> 2) + 1;
+        uint64_t sub = idx & 3;
+        if (msb == 63 && sub == 3) {
+            return ~(uint64_t)0;
+        }
+        return (5 + sub) << (msb - 2);
+    }
+
+    // copy of AsyncLogger::Metrics
+    struct MetricsSnapshot {
+        uint64_t latency[TZ_ASYNCLOG_LATENCY_BUCKETS];  // enqueue to sink accepted, by latency_bucket_upper()
+        uint64_t latency_count;
+        uint64_t latency_sum_ns;
+        uint64_t written[ALOG_LVL_MAX];     // msgs given to sink by level
+        uint64_t depth;             // queued at the last pop, bytes with QUEUE_RING
+        uint64_t depth_hwm;         // max depth in the current interval
+        uint64_t depth_hwm_last;    // max depth in the last full interval
+        uint64_t sink_ns;           // in ILogSink::sink_batch()
+        uint64_t format_ns;         // part of sink_ns, reported by formatting sinks
+        uint64_t write_ns;          // part of sink_ns, reported by formatting sinks
+        uint64_t write_bytes;
+        uint64_t flush_ns;
+
+        // upper bound of the bucket holding quantile q of latency, 0 if empty
+        uint64_t latency_quantile(double q) const {
+            if (this->latency_count == 0) {
+                return 0;
+            }
+            uint64_t rank = (uint64_t)(q * (double)this->latency_count);
+            if (rank >= this->latency_count) {
+                rank = this->latency_count - 1;     // q of 1.0 is the max
+            }
+            uint64_t seen = 0;
+            size_t last = 0;
+            for (size_t i = 0; i < TZ_ASYNCLOG_LATENCY_BUCKETS; ++i) {
+                if (this->latency[i] == 0) {
+                    continue;
+                }
+                seen += this->latency[i];
+                last = i;
+                if (seen > rank) {
+                    return latency_bucket_upper(i);
+                }
+            }
+            return seen != 0 ? latency_bucket_upper(last) : 0;  // buckets read a bit behind latency_count
+        }
+    };
+
     struct AsyncLogger {
         explicit AsyncLogger(size_t queue_size)
             : psink()
-            , q(queue_size)     // TODO: wrap queue size
+            , qp(new _LogQueue(queue_size))
+            , retired_queues(NULL)
+            , queue_mode(QUEUE_MPMC)
+            , thread_queue_size(16 * 1024)
+            , thread_queue_key()
+            , thread_queues(NULL)
+            , thread_queue_cursor(NULL)
+            , prio_stop_left(0)
+            , ring_size(16 * 1024 * 1024)
+            , use_pool(true)
+            , wait_mode(WAIT_SLEEP)
+            , consumer_parked(0)
+            , consumer_running(0)
+            , overflow_policy(OVERFLOW_DROP)
+            , deferred_format(false)
+            , prio_q()
+            , prio_level(ALOG_LVL_MAX)
+            , pressure(PRESSURE_NONE)
+            , shed_shards(_new_aligned<_ShedShard>(TZ_ASYNCLOG_SHED_SHARDS))
+            , marked_shed(0)
+            , coalesce_window_ms(0)
+            , byte_budget(0)
+            , metrics_enabled(false)
+            , metrics_epoch_ns(0)
+            , exporter()
+            , last_export_ms(0)
+            , shm_page(NULL)
+            , site_stats(false)
+            , last_site_report_ms(0)
+            , marked_drop(0)
+            , marked_seq(0)
+            , clock_source(CLOCKSRC_REALTIME)
+            , monotonic_stamp(false)
+            , tsc_base(0)
+            , tsc_base_ns(0)
+            , tsc_base_mono_ns(0)
+            , tsc_ns_per_tick(0)
+            , ticker_ns(0)
+            , ticker_running(0)
             , level(ALOG_LVL_DEBUG)
             , stopped(false)
             , internal_logfile(NULL)
             , flush_interval_ms(200)
             , format_buffer_size(TZ_ASYNCLOG_MAX_LEN)
+            , batch_size(64)
+            , spin_count(10)
+            , overflow_timeout_ms(0)
+            , ticker_interval_us(1000)
+            , drop_markers(false)
+            , shed_sample_pct(0)
+            , shed_sample_every(16)
+            , shed_sample_level(ALOG_LVL_DEBUG)
+            , shed_drop_pct(0)
+            , shed_drop_level(ALOG_LVL_INFO)
+            , metrics_interval_ms(1000)
+            , export_interval_ms(10000)
+            , site_report_interval_ms(0)
+            , site_report_top(10)
         {}
 
         ~AsyncLogger();
@@ -106,19 +510,57 @@ namespace tz { namespace asynclog {
             this->psink->logger = this;
             return *this;
         }
-        AsyncLogger &set_queue_size(size_t size) {
-            // TODO: wrap queue size
-            this->q.reset(size);
-            return *this;
-        }
+        // after start() the replaced queue stays allocated until destruction, an unchanged size is a no-op
+        AsyncLogger &set_queue_size(size_t size);  // power of 2, may be called after start() with QUEUE_MPMC
+        size_t get_queue_size();                    // slots of the QUEUE_MPMC queue
         AsyncLogger &set_level(LevelType level);
+        // not thread safe, call before start(). QUEUE_SPSC and QUEUE_RING can not be left.
+        AsyncLogger &set_queue_mode(QueueMode mode);
+        AsyncLogger &set_thread_queue_size(size_t size);
+        AsyncLogger &set_ring_size(size_t size);       // bytes, power of 2
+        AsyncLogger &set_use_pool(bool use_pool);       // call before start()
+        AsyncLogger &set_wait_mode(WaitMode mode);      // call before start()
+        AsyncLogger &set_overflow_policy(OverflowPolicy policy, uint32_t timeout_ms = 0);
+        // format on consumer thread. fmt passed to log() must outlive the msg, e.g. a literal.
+        AsyncLogger &set_deferred_format(bool deferred);
+        AsyncLogger &set_clock_source(ClockSource source);     // call before start()
+        AsyncLogger &set_monotonic_stamp(bool enable);          // fill LogMsg::mono_ns, call before start()
+        // write a warning line with the seq range when msgs were dropped or shed, off by default
+        AsyncLogger &set_drop_markers(bool enable);             // call before start()
+        // msgs at or above level go to a separate queue of size slots, drained first. call before start().
+        AsyncLogger &set_priority_lane(LevelType level, size_t size);
+        // shed low levels when the queue is sample_pct or drop_pct full, 0 disables a step
+        AsyncLogger &set_shedding(uint8_t sample_pct, uint32_t sample_every, uint8_t drop_pct);
+        // fold consecutive identical msgs of a thread into "last message repeated N times",
+        // reported at least every window_ms. 0 disables. call before start().
+        AsyncLogger &set_coalesce(uint32_t window_ms);
+        // cap on bytes of msgs made and not recycled yet, over it the overflow policy applies. 0 disables.
+        AsyncLogger &set_byte_budget(uint64_t bytes);
+        AsyncLogger &set_metrics(bool enable);     // fill metrics, call before start()
+        // run exporter on flush at most every interval_ms and at exit, turns metrics on. call before start().
+        AsyncLogger &set_metrics_exporter(const IMetricsExporter::Ptr &exporter, uint32_t interval_ms = 10000);
+        // publish stats in a shm_open() segment for asynclog-top, see shm_stats.hpp. call before start().
+        AsyncLogger &set_shm_stats(const std::string &name);
+        // count hits, bytes and drops of TZ_ASYNC_LOG sites, see get_log_site_stats() and dump_log_sites().
+        // the counters are per site, shared by every logger that turns this on.
+        // with report_interval_ms the consumer logs the top sites of each interval. call before start().
+        AsyncLogger &set_site_stats(bool enable, uint32_t report_interval_ms = 0, size_t report_top = 10);
+        void get_metrics(MetricsSnapshot &snap);
+        // used by formatting sinks, times from CLOCK_MONOTONIC
+        void record_format(uint64_t format_ns, uint64_t write_ns, size_t bytes);
 
         void log(LevelType level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
         void vlog(LevelType level, const char *fmt, va_list ap);
+        // used by TZ_ASYNC_LOG
+        void log_site(const LogSite *site, LevelType level, const char *fmt, ...)
+            __attribute__((format(printf, 4, 5)));
+        void vlog_site(const LogSite *site, LevelType level, const char *fmt, va_list ap);
+        void log_literal(const LogSite *site, LevelType level);     // site->state->literal must be set
         void binlog(LevelType level, const char *data, size_t size);
         bool sink(LogMsg *msg);
         void flush();
         void recycle(LogMsg *msg);
+        void recycle_batch(LogMsg **msgs, size_t n);
         LogMsg *create(size_t msg_size);
         bool should_log(LevelType level);
         void start();
@@ -126,13 +568,112 @@ namespace tz { namespace asynclog {
 
         // private
         static void *_consumer(void *arg);
+        size_t _pop_bulk(LogMsg **out, size_t max);
+        size_t _pop_ring_bulk(LogMsg **out, size_t max);
+        void _push_control(MsgType type);
+        void _discard(LogMsg *msg);     // drop a created msg that is not sunk
+        bool _may_fit(size_t msg_size, LevelType level);
+        LogMsg *_create(size_t msg_size, LevelType level);
+        bool _take_budget(uint64_t bytes, uint64_t budget);
+        void _return_budget(LogMsg *msg);
+        size_t _queue_depth();
+        void _record_depth(size_t popped);
+        void _record_sink(const uint64_t *stamps, size_t n, uint64_t begin_ns);
+        void _rotate_metrics(uint64_t now_ns);
+        void _flush_sink();
+        void _export_metrics(uint64_t now_ms, bool force);
+        void _publish_shm(bool stopped);
+        void _report_sites(uint64_t now_ms);
+        static void _consumer_add(turf::Atomic<uint64_t> &counter, uint64_t value);
+        bool _admit(LevelType level, uint8_t pressure);
+        void _count_shed();
+        void _collect_shed();
+        void _update_pressure();
+        void _update_pool_stats();
+        void _notify_consumer();
+        void _consumer_exit();
+        void _stamp(LogMsg *msg);
+        void _start_clock();
+        bool _calibrate_tsc();
+        void _convert_tsc(LogMsg **msgs, size_t n);
+        static void *_ticker(void *arg);
+        LogMsg **_join_chunks(LogMsg **batch, size_t &n);
+        void _flush_chunks(bool all);
+        LogMsg *_make_notice(LevelType level, uint64_t seq, const char *fmt, ...)
+            __attribute__((format(printf, 4, 5)));
+        void _mark_drops();
+        size_t _coalesce(LogMsg **msgs, size_t n);
+        LogMsg *_make_repeat_notice(_Repeat &r);
+        void _flush_repeats(bool all);
+        void _log_chunks(const LogSite *site, LevelType level, uint64_t seq, const char *data, size_t size);
+        template <class Writer> bool _log(LevelType level, Writer &w, uint64_t *pseq = NULL);
+        template <class Writer> bool _enqueue(LevelType level, uint64_t seq, Writer &w);
+        template <class Writer> LogMsg *_make_msg(LevelType level, uint64_t seq, Writer &w);
+        template <class Writer> bool _try_enqueue(LogMsg *&msg, LevelType level, uint64_t seq, Writer &w);
+        template <class Writer> bool _enqueue_blocking(LogMsg *&msg, LevelType level, uint64_t seq, Writer &w);
+        _ThreadQueue *_get_thread_queue();
+        size_t _pop_thread_queues_bulk(LogMsg **out, size_t max);
+        void _mark_stop_left();
+        size_t _pop_stop_left(LogMsg **out, size_t max);
+        void _reap_thread_queues();
+        static void _close_thread_queue(void *arg);
         void _internal_log(LevelType level, const char *fmt, ...);
 
         static pid_t get_tid();
 
         // private
         ILogSink::Ptr psink;
-        MPMCBoundedQueue<LogMsg *> q;
+        turf::Atomic<_LogQueue *> qp;
+        turf::Atomic<_LogQueue *> retired_queues;  // replaced by set_queue_size(), newest first
+        uint8_t queue_mode;     // QueueMode
+        size_t thread_queue_size;
+        pthread_key_t thread_queue_key;
+        turf::Atomic<_ThreadQueue *> thread_queues;     // newest first
+        _ThreadQueue *thread_queue_cursor;              // consumer only
+        size_t prio_stop_left;                          // consumer only, see _mark_stop_left()
+        mpsc_byte_ring ring;
+        size_t ring_size;
+        _Pool pool;
+        bool use_pool;
+        uint8_t wait_mode;      // WaitMode
+        _Event wakeup;
+        turf::Atomic<uint8_t> consumer_parked;
+        turf::Atomic<uint8_t> consumer_running;
+        uint8_t overflow_policy;    // OverflowPolicy
+        _WaitQueue space_waiters;   // producers blocked on full queue
+        bool deferred_format;
+        MPMCBoundedQueue<LogMsg *> prio_q;  // priority lane
+        LevelType prio_level;   // ALOG_LVL_MAX if there is no priority lane
+        turf::Atomic<uint8_t> pressure;     // Pressure, written by consumer
+        _ShedShard *shed_shards;    // summed into stats.shed by _collect_shed()
+        uint64_t marked_shed;   // consumer only
+        uint32_t coalesce_window_ms;
+        std::vector<_Repeat> repeats;       // consumer only, indexed by tid
+        std::vector<LogMsg *> coalesced;    // consumer only, output of _coalesce()
+        turf::Atomic<uint64_t> byte_budget;    // may change while producers read it
+        bool metrics_enabled;
+        uint64_t metrics_epoch_ns;  // consumer only, start of the depth interval
+        IMetricsExporter::Ptr exporter;
+        uint64_t last_export_ms;    // consumer only
+        std::string shm_stats_name;     // set_shm_stats() name, empty if disabled
+        std::string shm_name;
+        ShmStatsPage *shm_page;     // written by consumer
+        bool site_stats;
+        uint64_t last_site_report_ms;   // consumer only
+        std::map<const LogSite *, LogSiteStats> site_reported;  // consumer only, totals at the last report
+        std::vector<_Chunked> chunked;  // consumer only
+        std::vector<LogMsg *> joined;   // consumer only, output of _join_chunks() when msgs were chunked
+        uint64_t marked_drop;   // consumer only, drops reported by _mark_drops()
+        uint64_t marked_seq;
+        uint8_t clock_source;   // ClockSource
+        bool monotonic_stamp;
+        uint64_t tsc_base;
+        uint64_t tsc_base_ns;
+        uint64_t tsc_base_mono_ns;
+        double tsc_ns_per_tick;
+        turf::Atomic<uint64_t> ticker_ns;
+        turf::Atomic<uint8_t> ticker_running;
+        TZ_ASYNCLOG_SHARED_PTR<_Thread> ticker_thread;
         turf::Atomic<LevelType> level;
         TZ_ASYNCLOG_SHARED_PTR<_Thread> consumer_thread;
         bool stopped;
@@ -144,16 +685,86 @@ namespace tz { namespace asynclog {
             turf::Atomic<uint64_t> drop;
             turf::Atomic<uint64_t> err;
             turf::Atomic<uint64_t> trunc;
+            turf::Atomic<uint64_t> chunked;     // msgs split into chunks
+            // pool occupancy, updated by consumer
+            turf::Atomic<uint64_t> pool_bytes;
+            turf::Atomic<uint64_t> pool_inuse;
+            turf::Atomic<uint64_t> pool_large;
+            // producers blocked on full queue
+            turf::Atomic<uint64_t> blocked;
+            turf::Atomic<uint64_t> blocked_us;
+            turf::Atomic<uint64_t> block_timeout;
+            turf::Atomic<uint64_t> drop_level[ALOG_LVL_MAX];    // drop split by level
+            turf::Atomic<uint64_t> shed;        // rejected by should_log() under pressure, not in total.
+                                                // summed by consumer every flush interval and at exit
+            turf::Atomic<uint64_t> coalesced;   // repeated msgs not written
+            turf::Atomic<uint64_t> resize;      // queue resized after start()
+            // byte budget
+            turf::Atomic<uint64_t> inflight_bytes;
+            turf::Atomic<uint64_t> inflight_peak;
+            turf::Atomic<uint64_t> budget_full;     // create attempts refused
 
             Stats()
-                : total(0), drop(0), err(0), trunc(0)
-            {}
+                : total(0), drop(0), err(0), trunc(0), chunked(0)
+                , pool_bytes(0), pool_inuse(0), pool_large(0)
+                , blocked(0), blocked_us(0), block_timeout(0)
+                , shed(0), coalesced(0), resize(0)
+                , inflight_bytes(0), inflight_peak(0), budget_full(0)
+            {
+                for (size_t i = 0; i < ALOG_LVL_MAX; ++i) {
+                    this->drop_level[i].store(0, turf::Relaxed);
+                }
+            }
         } stats;
 
+        // written by consumer if metrics_enabled, see MetricsSnapshot
+        struct Metrics {
+            turf::Atomic<uint64_t> latency[TZ_ASYNCLOG_LATENCY_BUCKETS];
+            turf::Atomic<uint64_t> latency_count;
+            turf::Atomic<uint64_t> latency_sum_ns;
+            turf::Atomic<uint64_t> written[ALOG_LVL_MAX];
+            turf::Atomic<uint64_t> depth;
+            turf::Atomic<uint64_t> depth_hwm;
+            turf::Atomic<uint64_t> depth_hwm_last;
+            turf::Atomic<uint64_t> sink_ns;
+            turf::Atomic<uint64_t> format_ns;
+            turf::Atomic<uint64_t> write_ns;
+            turf::Atomic<uint64_t> write_bytes;
+            turf::Atomic<uint64_t> flush_ns;
+
+            Metrics()
+                : latency_count(0), latency_sum_ns(0)
+                , depth(0), depth_hwm(0), depth_hwm_last(0)
+                , sink_ns(0), format_ns(0), write_ns(0), write_bytes(0), flush_ns(0)
+            {
+                for (size_t i = 0; i < TZ_ASYNCLOG_LATENCY_BUCKETS; ++i) {
+                    this->latency[i].store(0, turf::Relaxed);
+                }
+                for (size_t i = 0; i < ALOG_LVL_MAX; ++i) {
+                    this->written[i].store(0, turf::Relaxed);
+                }
+            }
+        } metrics;
+
         // params
         // TODO: add to config
         uint32_t flush_interval_ms;
-        uint32_t format_buffer_size;
+        uint32_t format_buffer_size;    // longer msgs are split into chunks of this size
+        uint32_t batch_size;    // max msgs taken from queue at once by consumer
+        uint32_t spin_count;    // empty polls before the idle consumer yields or parks
+        uint32_t overflow_timeout_ms;
+        uint32_t ticker_interval_us;    // CLOCKSRC_TICKER resolution
+        bool drop_markers;      // consumer writes a line when msgs were dropped or shed
+        // load shedding ladder, percent of queue occupancy. 0 disables a step.
+        uint8_t shed_sample_pct;
+        uint32_t shed_sample_every;
+        LevelType shed_sample_level;
+        uint8_t shed_drop_pct;
+        LevelType shed_drop_level;
+        uint32_t metrics_interval_ms;   // depth high-watermark interval
+        uint32_t export_interval_ms;
+        uint32_t site_report_interval_ms;   // 0 disables the report
+        size_t site_report_top;
 
         // no copy
     private:
@@ -180,16 +791,19 @@ namespace tz { namespace asynclog {
     }
 
     inline void AsyncLogger::stop() {
-        if (this->stopped) {
-            return;
+        if (this->stopped || this->consumer_thread.get() == NULL) {
+            return;     // stopped or never started
         }
 
-        LogMsg *msg = new LogMsg();     // special msg type do not go through pool
-        msg->type = MSGTYPE_STOP;
-        while (!this->q.try_push_back(msg)) {}
+        this->_push_control(MSGTYPE_STOP);
         this->consumer_thread->join();
         this->stopped = true;
 
+        if (this->ticker_thread.get() != NULL) {
+            this->ticker_running.store(0, turf::Relaxed);
+            this->ticker_thread->join();
+        }
+
         if (this->internal_logfile && this->internal_logfile != stderr) {
             fclose(this->internal_logfile);     // ignore err
             this->internal_logfile = NULL;
@@ -198,158 +812,1470 @@ namespace tz { namespace asynclog {
 
     inline AsyncLogger::~AsyncLogger() {
         this->stop();
+
+        if (this->queue_mode == QUEUE_SPSC) {
+            ::pthread_key_delete(this->thread_queue_key);
+            _ThreadQueue *tq = this->thread_queues.load(turf::Acquire);
+            while (tq != NULL) {
+                _ThreadQueue *next = tq->next;
+                delete tq;
+                tq = next;
+            }
+        }
+
+        // producers are gone, retired queues can go too
+        _LogQueue *lq = this->retired_queues.load(turf::Acquire);
+        while (lq != NULL) {
+            _LogQueue *next = lq->retired_next;
+            delete lq;
+            lq = next;
+        }
+        delete this->qp.load(turf::Relaxed);
+
+        if (this->shm_page != NULL) {
+            _shm_stats_destroy(this->shm_page, this->shm_name);
+            this->shm_page = NULL;
+        }
+        _delete_aligned(this->shed_shards, TZ_ASYNCLOG_SHED_SHARDS);
     }
 
     inline bool AsyncLogger::sink(LogMsg *msg) {
         assert(msg != NULL);
-        return this->q.try_push_back(msg);
+        bool ok = true;
+        if (msg->level >= this->prio_level) {
+            ok = this->prio_q.try_push_back(msg);
+        } else if (this->queue_mode == QUEUE_RING) {
+            mpsc_byte_ring::commit(msg);    // space was taken by create()
+        } else if (this->queue_mode == QUEUE_SPSC) {
+            ok = this->_get_thread_queue()->q.try_push_back(msg);
+        } else {
+            ok = this->qp.load(turf::Acquire)->q.try_push_back(msg);
+        }
+
+        if (ok && this->wait_mode == WAIT_PARK) {
+            this->_notify_consumer();
+        }
+        return ok;
+    }
+
+    inline void AsyncLogger::_notify_consumer() {
+        // pairs with the fence in _consumer between announcing park and re-checking the queue.
+        // the push publishes with a release store (the slot seq of MPMC, the tail of SPSC, the
+        // header of the ring), and a later load may pass an earlier store even on x86. without
+        // the fence this load can see consumer_parked == 0 while the consumer, after its own
+        // fence, still sees the queue empty: it parks, nobody wakes it and the msg waits up to
+        // flush_interval_ms. no release or acquire order forbids that, only a full fence does.
+        turf::threadFenceSeqCst();
+        if (this->consumer_parked.load(turf::Relaxed) != 0
+            && this->consumer_parked.exchange(0, turf::Relaxed) != 0)
+        {
+            this->wakeup.notify();
+        }
     }
 
     inline void AsyncLogger::flush() {
-        LogMsg *msg = new LogMsg();
-        msg->type = MSGTYPE_FLUSH;
-        while (!this->q.try_push_back(msg)) {}
+        this->_push_control(MSGTYPE_FLUSH);
+    }
+
+    inline void AsyncLogger::_push_control(MsgType type) {
+        LogMsg *msg = NULL;
+        while ((msg = this->create(0)) == NULL) {}
+        msg->type = type;
+        msg->level = 0;     // never in the priority lane
+        msg->flags = 0;
+        msg->site = NULL;
+        msg->seq = 0;
+        msg->msg_size = 0;
+        while (!this->sink(msg)) {}
     }
 
     inline void AsyncLogger::recycle(LogMsg *msg) {
         assert(msg != NULL);
+        if (msg->flags & MSGFLAG_BUDGET) {
+            this->_return_budget(msg);
+        }
+        if (msg->flags & MSGFLAG_HEAP) {
+            ::free(msg);
+            return;
+        } else if (this->queue_mode == QUEUE_RING) {
+            return;     // released in bulk by consumer
+        } else if (this->use_pool) {
+            this->pool.free(msg);
+            return;
+        }
         ::free(msg);
     }
 
-    inline LogMsg *AsyncLogger::create(size_t msg_size) {
-        return (LogMsg *)::malloc(sizeof(LogMsg) + msg_size);
+    inline void AsyncLogger::_discard(LogMsg *msg) {
+        if (this->queue_mode == QUEUE_RING && !(msg->flags & MSGFLAG_HEAP)) {
+            if (msg->flags & MSGFLAG_BUDGET) {
+                this->_return_budget(msg);
+            }
+            mpsc_byte_ring::cancel(msg);
+            return;
+        }
+        this->recycle(msg);
     }
 
-    inline AsyncLogger &AsyncLogger::set_level(LevelType level) {
-        this->level.store(level, turf::Relaxed);
-        return *this;
+    inline void AsyncLogger::recycle_batch(LogMsg **msgs, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            this->recycle(msgs[i]);
+        }
     }
 
-    inline bool AsyncLogger::should_log(LevelType level) {
-        return level >= this->level.load(turf::Relaxed);
+    // returns NULL if QUEUE_RING is full
+    inline LogMsg *AsyncLogger::create(size_t msg_size) {
+        if (this->queue_mode == QUEUE_RING) {
+            return (LogMsg *)this->ring.reserve(sizeof(LogMsg) + msg_size);
+        } else if (this->use_pool) {
+            return (LogMsg *)this->pool.alloc(sizeof(LogMsg) + msg_size);
+        }
+        return (LogMsg *)::malloc(sizeof(LogMsg) + msg_size);
     }
 
-    inline void AsyncLogger::start() {
-        assert(this->psink.get() != NULL);
-        assert(this->consumer_thread.get() == NULL);
-        assert(this->internal_logfile == NULL);
+    // msg for level, sets flags to MSGFLAG_HEAP and MSGFLAG_BUDGET as needed, and msg_size.
+    // NULL if QUEUE_RING or the byte budget is full.
+    inline LogMsg *AsyncLogger::_create(size_t msg_size, LevelType level) {
+        uint8_t flags = 0;
+        uint64_t budget = this->byte_budget.load(turf::Relaxed);
+        if (budget != 0) {
+            if (!this->_take_budget(sizeof(LogMsg) + msg_size, budget)) {
+                return NULL;
+            }
+            flags |= MSGFLAG_BUDGET;
+        }
 
-        if (::getenv("ALOG_INTERNAL_LOG_STDERR")) {
-            this->internal_logfile = stderr;
-        } else if (const char *filename = ::getenv("ALOG_INTERNAL_LOG_FILE")) {
-            this->internal_logfile = fopen(filename, "at+");    // ignore err
-            // set line buffer
-            setvbuf(this->internal_logfile, NULL, _IOLBF, BUFSIZ);
+        LogMsg *msg = NULL;
+        if (this->queue_mode == QUEUE_RING && level >= this->prio_level) {
+            // the priority lane holds pointers, keep it off the ring
+            msg = (LogMsg *)::malloc(sizeof(LogMsg) + msg_size);
+            flags |= MSGFLAG_HEAP;
+        } else {
+            msg = this->create(msg_size);
         }
 
-        this->consumer_thread.reset(new _Thread(&AsyncLogger::_consumer, this));
+        if (msg == NULL) {
+            if (flags & MSGFLAG_BUDGET) {
+                this->stats.inflight_bytes.fetchSub(sizeof(LogMsg) + msg_size, turf::Relaxed);
+            }
+            return NULL;
+        }
+        msg->flags = flags;
+        msg->msg_size = msg_size;
+        return msg;
     }
 
-    inline bool _wait_a_moment(size_t attempts) {
-        // TODO: adjust this
-        const size_t k_spin_threshold = 10;
-        const size_t k_yield_threshold = 100;
-        const size_t k_max_sleep_us_log2 = 13;
-        const size_t k_max_sleep_us = 8 * 1024;     // 8ms
+    // false if a msg of msg_size can never be created, waiting for room is pointless then
+    inline bool AsyncLogger::_may_fit(size_t msg_size, LevelType level) {
+        uint64_t budget = this->byte_budget.load(turf::Relaxed);
+        if (budget != 0 && sizeof(LogMsg) + msg_size > budget) {
+            return false;   // over the whole budget, dropped and counted in budget_full
+        }
+        return this->queue_mode != QUEUE_RING || level >= this->prio_level
+            || sizeof(LogMsg) + msg_size <= this->ring.max_size();
+    }
 
-        if (attempts < k_spin_threshold) {
-            // spin
-            return false;
-        } else if (attempts < k_yield_threshold) {
-            ::sched_yield();
+    inline bool AsyncLogger::_take_budget(uint64_t bytes, uint64_t budget) {
+        uint64_t inflight = this->stats.inflight_bytes.fetchAdd(bytes, turf::Relaxed) + bytes;
+        if (inflight > budget) {
+            this->stats.inflight_bytes.fetchSub(bytes, turf::Relaxed);
+            this->stats.budget_full.fetchAdd(1, turf::Relaxed);
             return false;
-        } else {
-            uint64_t us;
-            if (attempts - k_yield_threshold > k_max_sleep_us_log2) {
-                us = k_max_sleep_us;
-            } else {
-                us = 1llu << (attempts - k_yield_threshold);
-            }
-            timespec ts = {0, (long)us * 1000};
-            ::nanosleep(&ts, NULL);
-            return true;
         }
+        uint64_t peak = this->stats.inflight_peak.load(turf::Relaxed);
+        while (inflight > peak
+            && !this->stats.inflight_peak.compareExchangeWeak(peak, inflight, turf::Relaxed, turf::Relaxed))
+        {}
+        return true;
     }
 
-    inline uint64_t _timeval_to_msec(const struct timeval &tv) {
-        return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    inline void AsyncLogger::_return_budget(LogMsg *msg) {
+        this->stats.inflight_bytes.fetchSub(sizeof(LogMsg) + msg->msg_size, turf::Relaxed);
     }
 
-    inline uint64_t _get_time_msec() {
-        struct timeval tv;
-        ::gettimeofday(&tv, NULL);
-        return _timeval_to_msec(tv);
+    inline AsyncLogger &AsyncLogger::set_level(LevelType level) {
+        this->level.store(level, turf::Relaxed);
+        return *this;
     }
 
-    inline void *AsyncLogger::_consumer(void *arg) {
-        AsyncLogger *logger = (AsyncLogger *)arg;
-        ILogSink *sink = logger->psink.get();
-        assert(sink != NULL);
-
-        size_t attempts = 0;
-        uint64_t last_flush = _get_time_msec();
-        while (true) {
-            LogMsg *msg = NULL;
-            if (!logger->q.try_pop_front(msg)) {
-                // queue empty, wait a moment
-                bool sleeped = _wait_a_moment(++attempts);
-                if (sleeped) {
-                    // check for flush
-                    uint64_t now = _get_time_msec();
-                    if (now >= last_flush + logger->flush_interval_ms) {
-                        last_flush = now;
-                        sink->flush();
-                    }
-                }
-                // retry
-                continue;
-            }
-
-            attempts = 0;
-            switch (msg->type) {
-            case MSGTYPE_STOP:
-                delete msg;
-                sink->flush();
-                sink->close();
-                return NULL;    // thread exit
-            case MSGTYPE_FLUSH:
-                delete msg;
-                last_flush = _get_time_msec();
-                sink->flush();
-                break;
-            case MSGTYPE_LOG:
-                // check for flush before msg is deleted
-                if (_timeval_to_msec(msg->time) >= last_flush + logger->flush_interval_ms) {
-                    last_flush = _timeval_to_msec(msg->time);
-                    sink->sink(msg);    // msg moved to sink
-                    sink->flush();
-                } else {
-                    sink->sink(msg);
-                }
-                break;
-            default:
-                assert(!"unknown MSGTYPE");
+    inline AsyncLogger &AsyncLogger::set_queue_mode(QueueMode mode) {
+        assert(this->consumer_thread.get() == NULL);
+        if (mode == QUEUE_SPSC && this->queue_mode != QUEUE_SPSC) {
+            int rc = ::pthread_key_create(&this->thread_queue_key, &AsyncLogger::_close_thread_queue);
+            if (rc != 0) {
+                throw _ThreadException("pthread_key_create() failed", rc);
             }
-        }   // while true
+            this->queue_mode = QUEUE_SPSC;
+        } else if (mode == QUEUE_RING && this->queue_mode == QUEUE_MPMC) {
+            this->ring.reset(this->ring_size);
+            this->queue_mode = QUEUE_RING;
+        } else {
+            // thread queues or ring records may exist already
+            assert(mode == this->queue_mode && "can not switch away from QUEUE_SPSC or QUEUE_RING");
+        }
+        return *this;
     }
 
-    inline const char *_internal_log_level_string(LevelType level) {
-        switch (level) {
-#define _INTERNAL_LOG_LEVEL_CASE(lvl) case lvl: return #lvl
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_DEBUG);
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_INFO);
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_NOTICE);
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_WARN);
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_ERROR);
-        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_FATAL);
-#undef _INTERNAL_LOG_LEVEL_CASE
-        default: return "ALOG_LVL_UNKNOWN";
+    inline AsyncLogger &AsyncLogger::set_queue_size(size_t size) {
+        if (this->consumer_thread.get() == NULL) {
+            this->qp.load(turf::Relaxed)->q.reset(size);
+            return *this;
+        }
+        if (this->queue_mode != QUEUE_MPMC) {
+            this->_internal_log(ALOG_LVL_WARN, "queue size can not change after start() in this queue mode");
+            return *this;
+        }
+        if (size < 2 || (size & (size - 1)) != 0) {
+            this->_internal_log(ALOG_LVL_ERROR, "queue size %lu is not a power of 2", (unsigned long)size);
+            return *this;
+        }
+        if (size == this->get_queue_size()) {
+            return *this;
         }
+
+        // producers holding the old queue may still push to it, and nothing tracks when the last
+        // one is done, so it is never freed while running. the consumer drains it before the new one.
+        _LogQueue *fresh = new _LogQueue(size);
+        _LogQueue *old = this->qp.exchange(fresh, turf::AcquireRelease);
+        _LogQueue *head = this->retired_queues.load(turf::Relaxed);
+        do {
+            old->retired_next = head;
+        } while (!this->retired_queues.compareExchangeWeak(head, old, turf::Release, turf::Relaxed));
+
+        this->stats.resize.fetchAdd(1, turf::Relaxed);
+        this->space_waiters.notify_all();   // there may be room now
+        return *this;
     }
 
-    inline void AsyncLogger::_internal_log(LevelType level, const char *fmt, ...) {
-        if (this->internal_logfile == NULL) {
-            return;
+    inline size_t AsyncLogger::get_queue_size() {
+        return this->qp.load(turf::Acquire)->q.capacity();
+    }
+
+    inline AsyncLogger &AsyncLogger::set_thread_queue_size(size_t size) {
+        // takes effect on threads registered afterwards
+        this->thread_queue_size = size;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_ring_size(size_t size) {
+        assert(this->consumer_thread.get() == NULL);
+        this->ring_size = size;
+        if (this->queue_mode == QUEUE_RING) {
+            this->ring.reset(size);
+        }
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_use_pool(bool use_pool) {
+        assert(this->consumer_thread.get() == NULL);
+        this->use_pool = use_pool;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_wait_mode(WaitMode mode) {
+        assert(this->consumer_thread.get() == NULL);
+        this->wait_mode = mode;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_overflow_policy(OverflowPolicy policy, uint32_t timeout_ms) {
+        this->overflow_policy = policy;
+        this->overflow_timeout_ms = timeout_ms;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_deferred_format(bool deferred) {
+        this->deferred_format = deferred;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_clock_source(ClockSource source) {
+        assert(this->consumer_thread.get() == NULL);
+        this->clock_source = source;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_monotonic_stamp(bool enable) {
+        assert(this->consumer_thread.get() == NULL);
+        this->monotonic_stamp = enable;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_drop_markers(bool enable) {
+        assert(this->consumer_thread.get() == NULL);
+        this->drop_markers = enable;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_priority_lane(LevelType level, size_t size) {
+        assert(this->consumer_thread.get() == NULL);
+        assert(level > 0);
+        this->prio_q.reset(size);
+        this->prio_level = level;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_shedding(uint8_t sample_pct, uint32_t sample_every, uint8_t drop_pct) {
+        this->shed_sample_pct = sample_pct;
+        this->shed_sample_every = sample_every != 0 ? sample_every : 1;
+        this->shed_drop_pct = drop_pct;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_byte_budget(uint64_t bytes) {
+        // msgs made before are not counted, so this is fine on a running logger
+        this->byte_budget.store(bytes, turf::Relaxed);
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_metrics(bool enable) {
+        assert(this->consumer_thread.get() == NULL);
+        this->metrics_enabled = enable;
+        return *this;
+    }
+
+    inline void AsyncLogger::get_metrics(MetricsSnapshot &snap) {
+        Metrics &m = this->metrics;
+        for (size_t i = 0; i < TZ_ASYNCLOG_LATENCY_BUCKETS; ++i) {
+            snap.latency[i] = m.latency[i].load(turf::Relaxed);
+        }
+        snap.latency_count = m.latency_count.load(turf::Relaxed);
+        snap.latency_sum_ns = m.latency_sum_ns.load(turf::Relaxed);
+        for (size_t i = 0; i < ALOG_LVL_MAX; ++i) {
+            snap.written[i] = m.written[i].load(turf::Relaxed);
+        }
+        snap.depth = m.depth.load(turf::Relaxed);
+        snap.depth_hwm = m.depth_hwm.load(turf::Relaxed);
+        snap.depth_hwm_last = m.depth_hwm_last.load(turf::Relaxed);
+        snap.sink_ns = m.sink_ns.load(turf::Relaxed);
+        snap.format_ns = m.format_ns.load(turf::Relaxed);
+        snap.write_ns = m.write_ns.load(turf::Relaxed);
+        snap.write_bytes = m.write_bytes.load(turf::Relaxed);
+        snap.flush_ns = m.flush_ns.load(turf::Relaxed);
+    }
+
+    inline AsyncLogger &AsyncLogger::set_metrics_exporter(const IMetricsExporter::Ptr &exporter, uint32_t interval_ms) {
+        assert(this->consumer_thread.get() == NULL);
+        this->exporter = exporter;
+        this->export_interval_ms = interval_ms;
+        this->metrics_enabled = true;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_site_stats(bool enable, uint32_t report_interval_ms, size_t report_top) {
+        assert(this->consumer_thread.get() == NULL);
+        this->site_stats = enable;
+        this->site_report_interval_ms = enable ? report_interval_ms : 0;
+        this->site_report_top = report_top;
+        return *this;
+    }
+
+    inline AsyncLogger &AsyncLogger::set_shm_stats(const std::string &name) {
+        if (this->consumer_thread.get() != NULL) {
+            // config reload on a running logger
+            if (name != this->shm_stats_name) {
+                this->_internal_log(ALOG_LVL_WARN, "shm stats can only be set before start(), ignored");
+            }
+            return *this;
+        }
+        this->shm_stats_name = name;
+        return *this;
+    }
+
+    inline void AsyncLogger::record_format(uint64_t format_ns, uint64_t write_ns, size_t bytes) {
+        _consumer_add(this->metrics.format_ns, format_ns);
+        _consumer_add(this->metrics.write_ns, write_ns);
+        _consumer_add(this->metrics.write_bytes, bytes);
+    }
+
+    inline AsyncLogger &AsyncLogger::set_coalesce(uint32_t window_ms) {
+        assert(this->consumer_thread.get() == NULL);
+        this->coalesce_window_ms = window_ms;
+        return *this;
+    }
+
+    inline bool AsyncLogger::should_log(LevelType level) {
+        if (level < this->level.load(turf::Relaxed)) {
+            return false;
+        }
+        uint8_t pressure = this->pressure.load(turf::Relaxed);
+        return pressure == PRESSURE_NONE || this->_admit(level, pressure);
+    }
+
+    inline bool AsyncLogger::_admit(LevelType level, uint8_t pressure) {
+        if (pressure >= PRESSURE_SHED && level <= this->shed_drop_level) {
+            this->_count_shed();
+            return false;
+        }
+        if (level <= this->shed_sample_level) {
+            static __thread uint32_t tick;  // per thread, no shared counter
+            if (tick++ % this->shed_sample_every != 0) {
+                this->_count_shed();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // shedding happens when producers are busiest, keep them off a shared line
+    inline void AsyncLogger::_count_shed() {
+        _ShedShard &shard = this->shed_shards[(uint32_t)get_tid() & (TZ_ASYNCLOG_SHED_SHARDS - 1)];
+        shard.n.fetchAdd(1, turf::Relaxed);
+    }
+
+    inline void AsyncLogger::_collect_shed() {
+        uint64_t shed = 0;
+        for (size_t i = 0; i < TZ_ASYNCLOG_SHED_SHARDS; ++i) {
+            shed += this->shed_shards[i].n.load(turf::Relaxed);
+        }
+        this->stats.shed.store(shed, turf::Relaxed);
+    }
+
+    inline void AsyncLogger::start() {
+        assert(this->psink.get() != NULL);
+        assert(this->consumer_thread.get() == NULL);
+        assert(this->internal_logfile == NULL);
+
+        if (::getenv("ALOG_INTERNAL_LOG_STDERR")) {
+            this->internal_logfile = stderr;
+        } else if (const char *filename = ::getenv("ALOG_INTERNAL_LOG_FILE")) {
+            this->internal_logfile = fopen(filename, "at+");    // ignore err
+            // set line buffer
+            setvbuf(this->internal_logfile, NULL, _IOLBF, BUFSIZ);
+        }
+
+        if (this->wait_mode == WAIT_PARK && !this->wakeup.open()) {
+            this->_internal_log(ALOG_LVL_ERROR, "can not create wakeup event, fallback to WAIT_SLEEP");
+            this->wait_mode = WAIT_SLEEP;
+        }
+
+        this->_start_clock();
+
+        if (this->queue_mode == QUEUE_RING) {
+            // long msgs are chunked to records the ring can hold
+            size_t max_size = this->ring.max_size();
+            if (max_size > sizeof(LogMsg) + 64 && max_size - sizeof(LogMsg) < this->format_buffer_size) {
+                this->format_buffer_size = (uint32_t)(max_size - sizeof(LogMsg));
+            }
+        }
+
+        if (!this->shm_stats_name.empty()) {
+            this->shm_name = _shm_stats_name(::getpid(), this->shm_stats_name);
+            this->shm_page = _shm_stats_create(this->shm_name, this->shm_stats_name);
+            if (this->shm_page == NULL && errno == EEXIST) {
+                // another logger of this process, or a leftover of a dead process with our pid
+                this->_internal_log(ALOG_LVL_ERROR, "shm stats page %s exists, pick another name or remove it",
+                    this->shm_name.c_str());
+            } else if (this->shm_page == NULL) {
+                this->_internal_log(ALOG_LVL_ERROR, "can not create shm stats page %s. [errno:%d]",
+                    this->shm_name.c_str(), errno);
+            }
+        }
+
+        this->consumer_running.store(1, turf::Release);
+        this->consumer_thread.reset(new _Thread(&AsyncLogger::_consumer, this));
+    }
+
+    inline bool _wait_a_moment(size_t attempts, size_t spin_threshold) {
+        // TODO: adjust this
+        const size_t k_spin_threshold = spin_threshold;
+        const size_t k_yield_threshold = spin_threshold + 90;
+        const size_t k_max_sleep_us_log2 = 13;
+        const size_t k_max_sleep_us = 8 * 1024;     // 8ms
+
+        if (attempts < k_spin_threshold) {
+            // spin
+            return false;
+        } else if (attempts < k_yield_threshold) {
+            ::sched_yield();
+            return false;
+        } else {
+            uint64_t us;
+            if (attempts - k_yield_threshold > k_max_sleep_us_log2) {
+                us = k_max_sleep_us;
+            } else {
+                us = 1llu << (attempts - k_yield_threshold);
+            }
+            timespec ts = {0, (long)us * 1000};
+            ::nanosleep(&ts, NULL);
+            return true;
+        }
+    }
+
+    inline uint64_t _timeval_to_msec(const struct timeval &tv) {
+        return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+
+    inline uint64_t _get_monotonic_usec() {
+        timespec ts = {0, 0};
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    inline uint64_t _get_time_msec() {
+        struct timeval tv;
+        ::gettimeofday(&tv, NULL);
+        return _timeval_to_msec(tv);
+    }
+
+    inline uint64_t _get_clock_nsec(clockid_t clock) {
+        timespec ts = {0, 0};
+        ::clock_gettime(clock, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+#ifdef CLOCK_REALTIME_COARSE
+#   define TZ_ASYNCLOG_CLOCK_REALTIME_COARSE   CLOCK_REALTIME_COARSE
+#   define TZ_ASYNCLOG_CLOCK_MONOTONIC_COARSE  CLOCK_MONOTONIC_COARSE
+#else
+#   define TZ_ASYNCLOG_CLOCK_REALTIME_COARSE   CLOCK_REALTIME
+#   define TZ_ASYNCLOG_CLOCK_MONOTONIC_COARSE  CLOCK_MONOTONIC
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define TZ_ASYNCLOG_HAVE_TSC 1
+#else
+#   define TZ_ASYNCLOG_HAVE_TSC 0
+#endif
+
+    inline uint64_t _rdtsc() {
+#if TZ_ASYNCLOG_HAVE_TSC
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+#else
+        return 0;
+#endif
+    }
+
+    inline void AsyncLogger::_stamp(LogMsg *msg) {
+        msg->mono_ns = 0;
+        switch (this->clock_source) {
+        case CLOCKSRC_TSC:
+            msg->time_ns = _rdtsc();    // mono_ns is derived from it too
+            return;
+        case CLOCKSRC_TICKER:
+            msg->time_ns = this->ticker_ns.load(turf::Relaxed);
+            break;
+        case CLOCKSRC_COARSE:
+            msg->time_ns = _get_clock_nsec(TZ_ASYNCLOG_CLOCK_REALTIME_COARSE);
+            break;
+        default:
+            msg->time_ns = _get_clock_nsec(CLOCK_REALTIME);
+            if (this->monotonic_stamp) {
+                msg->mono_ns = _get_clock_nsec(CLOCK_MONOTONIC);
+            }
+            return;
+        }
+        if (this->monotonic_stamp) {
+            msg->mono_ns = _get_clock_nsec(TZ_ASYNCLOG_CLOCK_MONOTONIC_COARSE);
+        }
+    }
+
+    // maps tsc to wall time, measured once over a short sleep
+    inline bool AsyncLogger::_calibrate_tsc() {
+        if (!TZ_ASYNCLOG_HAVE_TSC) {
+            return false;
+        }
+
+        uint64_t tsc0 = _rdtsc();
+        uint64_t ns0 = _get_clock_nsec(CLOCK_MONOTONIC);
+
+        timespec pause = {0, 20 * 1000 * 1000};     // 20ms
+        ::nanosleep(&pause, NULL);
+
+        uint64_t tsc1 = _rdtsc();
+        uint64_t ns1 = _get_clock_nsec(CLOCK_MONOTONIC);
+        uint64_t wall1 = _get_clock_nsec(CLOCK_REALTIME);
+        if (tsc1 <= tsc0 || ns1 <= ns0) {
+            return false;
+        }
+
+        this->tsc_base = tsc1;
+        this->tsc_base_ns = wall1;
+        this->tsc_base_mono_ns = ns1;
+        this->tsc_ns_per_tick = (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+        return true;
+    }
+
+    inline void AsyncLogger::_convert_tsc(LogMsg **msgs, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            LogMsg *msg = msgs[i];
+            if (msg->type != MSGTYPE_LOG) {
+                continue;
+            }
+            int64_t ticks = (int64_t)(msg->time_ns - this->tsc_base);
+            int64_t delta = (int64_t)((double)ticks * this->tsc_ns_per_tick);
+            msg->time_ns = this->tsc_base_ns + delta;
+            if (this->monotonic_stamp) {
+                msg->mono_ns = this->tsc_base_mono_ns + delta;
+            }
+        }
+    }
+
+    inline void AsyncLogger::_start_clock() {
+        if (this->clock_source == CLOCKSRC_TSC && !this->_calibrate_tsc()) {
+            this->_internal_log(ALOG_LVL_ERROR, "tsc not available, fallback to CLOCKSRC_REALTIME");
+            this->clock_source = CLOCKSRC_REALTIME;
+        }
+        if (this->clock_source == CLOCKSRC_TICKER) {
+            this->ticker_ns.store(_get_clock_nsec(CLOCK_REALTIME), turf::Relaxed);
+            this->ticker_running.store(1, turf::Relaxed);
+            this->ticker_thread.reset(new _Thread(&AsyncLogger::_ticker, this));
+        }
+    }
+
+    inline void *AsyncLogger::_ticker(void *arg) {
+        AsyncLogger *logger = (AsyncLogger *)arg;
+        while (logger->ticker_running.load(turf::Relaxed)) {
+            timespec ts = {0, (long)logger->ticker_interval_us * 1000};
+            ::nanosleep(&ts, NULL);
+            logger->ticker_ns.store(_get_clock_nsec(CLOCK_REALTIME), turf::Relaxed);
+        }
+        return NULL;
+    }
+
+    inline _ThreadQueue *AsyncLogger::_get_thread_queue() {
+        _ThreadQueue *tq = (_ThreadQueue *)::pthread_getspecific(this->thread_queue_key);
+        if (tq == NULL) {
+            // first log from this thread, register a new ring
+            tq = new _ThreadQueue(this->thread_queue_size);
+            ::pthread_setspecific(this->thread_queue_key, tq);
+
+            _ThreadQueue *head = this->thread_queues.load(turf::Relaxed);
+            do {
+                tq->next = head;
+            } while (!this->thread_queues.compareExchangeWeak(head, tq, turf::Release, turf::Relaxed));
+        }
+        return tq;
+    }
+
+    inline void AsyncLogger::_close_thread_queue(void *arg) {
+        // thread exiting, consumer will drain and free the ring
+        _ThreadQueue *tq = (_ThreadQueue *)arg;
+        tq->closed.store(1, turf::Release);
+    }
+
+    inline size_t AsyncLogger::_pop_thread_queues_bulk(LogMsg **out, size_t max) {
+        _ThreadQueue *head = this->thread_queues.load(turf::Acquire);
+        if (head == NULL) {
+            return 0;
+        }
+
+        // round-robin, start from the ring after the one served last
+        _ThreadQueue *start = this->thread_queue_cursor ? this->thread_queue_cursor : head;
+        _ThreadQueue *tq = start;
+        size_t n = 0;
+        do {
+            n += tq->q.try_pop_bulk(out + n, max - n);
+            tq = tq->next ? tq->next : head;
+        } while (n < max && tq != start);
+
+        this->thread_queue_cursor = tq;
+        return n;
+    }
+
+    // with QUEUE_SPSC the rings are not ordered with the one STOP came through. what they hold
+    // when STOP is seen is still delivered, later msgs are not, so busy threads can not hold up stop().
+    inline void AsyncLogger::_mark_stop_left() {
+        this->prio_stop_left = this->prio_level < ALOG_LVL_MAX ? this->prio_q.size_approx() : 0;
+        for (_ThreadQueue *tq = this->thread_queues.load(turf::Acquire); tq != NULL; tq = tq->next) {
+            tq->stop_left = tq->q.size_approx();
+        }
+    }
+
+    inline size_t AsyncLogger::_pop_stop_left(LogMsg **out, size_t max) {
+        size_t n = 0;
+        if (this->prio_stop_left != 0) {
+            size_t want = this->prio_stop_left < max ? this->prio_stop_left : max;
+            size_t got = this->prio_q.try_pop_bulk_single(out, want);
+            this->prio_stop_left = got < want ? 0 : this->prio_stop_left - got;
+            n += got;
+        }
+        for (_ThreadQueue *tq = this->thread_queues.load(turf::Acquire); tq != NULL && n < max; tq = tq->next) {
+            if (tq->stop_left == 0) {
+                continue;
+            }
+            size_t want = tq->stop_left < max - n ? tq->stop_left : max - n;
+            size_t got = tq->q.try_pop_bulk(out + n, want);
+            tq->stop_left = got < want ? 0 : tq->stop_left - got;
+            n += got;
+        }
+        return n;
+    }
+
+    inline void AsyncLogger::_reap_thread_queues() {
+        // free rings of exited threads. the head is never unlinked since producers CAS on it.
+        _ThreadQueue *prev = this->thread_queues.load(turf::Acquire);
+        if (prev == NULL) {
+            return;
+        }
+
+        this->thread_queue_cursor = NULL;
+
+        _ThreadQueue *tq = prev->next;
+        while (tq != NULL) {
+            // check closed before emptiness, the owner will not push after closing
+            if (tq->closed.load(turf::Acquire) && tq->q.empty()) {
+                prev->next = tq->next;
+                delete tq;
+            } else {
+                prev = tq;
+            }
+            tq = prev->next;
+        }
+    }
+
+    inline size_t AsyncLogger::_pop_ring_bulk(LogMsg **out, size_t max) {
+        // msgs of the previous batch are done with once the consumer comes back
+        if (this->ring.unreleased() >= this->ring.capacity() / 8
+            || this->space_waiters.waiters.load(turf::Relaxed) != 0)
+        {
+            this->ring.release();
+            this->space_waiters.notify_all();   // room comes back here, not when the batch is done
+        }
+
+        size_t n = 0;
+        while (n < max) {
+            LogMsg *msg = (LogMsg *)this->ring.front();
+            if (msg == NULL) {
+                break;
+            }
+            out[n++] = msg;
+            this->ring.pop_front();     // space is not reused until release()
+        }
+
+        if (n == 0) {
+            this->ring.release();
+            this->space_waiters.notify_all();
+        }
+        return n;
+    }
+
+    inline void AsyncLogger::_update_pool_stats() {
+        if (this->queue_mode == QUEUE_RING || !this->use_pool) {
+            return;
+        }
+        this->stats.pool_inuse.store(this->pool.flush_pending(), turf::Relaxed);
+        this->stats.pool_bytes.store(this->pool.slab_bytes.load(turf::Relaxed), turf::Relaxed);
+        this->stats.pool_large.store(this->pool.large.load(turf::Relaxed), turf::Relaxed);
+    }
+
+    // occupancy of the regular queue, the fullest ring with QUEUE_SPSC
+    inline void AsyncLogger::_update_pressure() {
+        if (this->shed_sample_pct == 0 && this->shed_drop_pct == 0) {
+            return;
+        }
+
+        size_t pct = 0;
+        if (this->queue_mode == QUEUE_RING) {
+            pct = this->ring.size_approx() * 100 / this->ring.capacity();
+        } else if (this->queue_mode == QUEUE_SPSC) {
+            for (_ThreadQueue *tq = this->thread_queues.load(turf::Acquire); tq != NULL; tq = tq->next) {
+                size_t p = tq->q.size_approx() * 100 / tq->q.capacity();
+                pct = p > pct ? p : pct;
+            }
+        } else {
+            _LogQueue *lq = this->qp.load(turf::Acquire);
+            pct = lq->q.size_approx() * 100 / lq->q.capacity();
+        }
+
+        uint8_t pressure = PRESSURE_NONE;
+        if (this->shed_drop_pct != 0 && pct >= this->shed_drop_pct) {
+            pressure = PRESSURE_SHED;
+        } else if (this->shed_sample_pct != 0 && pct >= this->shed_sample_pct) {
+            pressure = PRESSURE_SAMPLE;
+        }
+        if (pressure != this->pressure.load(turf::Relaxed)) {
+            this->pressure.store(pressure, turf::Relaxed);
+        }
+    }
+
+    // msgs waiting in all queues, bytes with QUEUE_RING
+    inline size_t AsyncLogger::_queue_depth() {
+        size_t depth = 0;
+        if (this->prio_level < ALOG_LVL_MAX) {
+            depth += this->prio_q.size_approx();
+        }
+        if (this->queue_mode == QUEUE_RING) {
+            depth += this->ring.size_approx();
+        } else if (this->queue_mode == QUEUE_SPSC) {
+            for (_ThreadQueue *tq = this->thread_queues.load(turf::Acquire); tq != NULL; tq = tq->next) {
+                depth += tq->q.size_approx();
+            }
+        } else {
+            depth += this->qp.load(turf::Acquire)->q.size_approx();
+            for (_LogQueue *lq = this->retired_queues.load(turf::Acquire); lq != NULL; lq = lq->retired_next) {
+                depth += lq->q.size_approx();
+            }
+        }
+        return depth;
+    }
+
+    // single writer, no atomic rmw needed
+    inline void AsyncLogger::_consumer_add(turf::Atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(turf::Relaxed) + value, turf::Relaxed);
+    }
+
+    inline void AsyncLogger::_record_depth(size_t popped) {
+        uint64_t depth = popped + this->_queue_depth();
+        this->metrics.depth.store(depth, turf::Relaxed);
+        if (depth > this->metrics.depth_hwm.load(turf::Relaxed)) {
+            this->metrics.depth_hwm.store(depth, turf::Relaxed);
+        }
+    }
+
+    inline void AsyncLogger::_rotate_metrics(uint64_t now_ns) {
+        if (now_ns < this->metrics_epoch_ns + (uint64_t)this->metrics_interval_ms * 1000000) {
+            return;
+        }
+        this->metrics_epoch_ns = now_ns;
+        this->metrics.depth_hwm_last.store(this->metrics.depth_hwm.load(turf::Relaxed), turf::Relaxed);
+        this->metrics.depth_hwm.store(this->metrics.depth.load(turf::Relaxed), turf::Relaxed);
+    }
+
+    // stamps are time_ns of the msgs taken before sink_batch(), begin_ns is CLOCK_MONOTONIC
+    inline void AsyncLogger::_record_sink(const uint64_t *stamps, size_t n, uint64_t begin_ns) {
+        uint64_t now = _get_clock_nsec(CLOCK_REALTIME);
+        _consumer_add(this->metrics.sink_ns, _get_clock_nsec(CLOCK_MONOTONIC) - begin_ns);
+
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t latency = now > stamps[i] ? now - stamps[i] : 0;
+            sum += latency;
+            _consumer_add(this->metrics.latency[_latency_bucket(latency)], 1);
+        }
+        _consumer_add(this->metrics.latency_count, n);
+        _consumer_add(this->metrics.latency_sum_ns, sum);
+        this->_rotate_metrics(now);
+    }
+
+    inline void AsyncLogger::_flush_sink() {
+        if (!this->metrics_enabled) {
+            this->psink->flush();
+            return;
+        }
+        uint64_t begin = _get_clock_nsec(CLOCK_MONOTONIC);
+        this->psink->flush();
+        _consumer_add(this->metrics.flush_ns, _get_clock_nsec(CLOCK_MONOTONIC) - begin);
+    }
+
+    inline void AsyncLogger::_export_metrics(uint64_t now_ms, bool force) {
+        if (this->exporter.get() == NULL
+            || (!force && now_ms < this->last_export_ms + this->export_interval_ms))
+        {
+            return;
+        }
+        this->last_export_ms = now_ms;
+        this->exporter->export_metrics(*this);
+    }
+
+    // top sites by bytes since the last report
+    inline void AsyncLogger::_report_sites(uint64_t now_ms) {
+        if (this->site_report_interval_ms == 0) {
+            return;
+        }
+        if (this->last_site_report_ms == 0) {
+            this->last_site_report_ms = now_ms;     // first interval starts now
+            return;
+        }
+        if (now_ms < this->last_site_report_ms + this->site_report_interval_ms) {
+            return;
+        }
+        double secs = (now_ms - this->last_site_report_ms) / 1000.0;
+        this->last_site_report_ms = now_ms;
+
+        std::vector<LogSiteStats> sites;
+        get_log_site_stats(sites);
+        size_t n = 0;
+        for (size_t i = 0; i < sites.size(); ++i) {
+            LogSiteStats &prev = this->site_reported[sites[i].site];
+            LogSiteStats delta = sites[i];
+            delta.hits -= prev.hits;
+            delta.bytes -= prev.bytes;
+            delta.drops -= prev.drops;
+            prev = sites[i];
+            if (delta.hits != 0 || delta.drops != 0) {
+                sites[n++] = delta;
+            }
+        }
+        sites.resize(n);
+        _top_log_sites(sites, this->site_report_top);
+
+        for (size_t i = 0; i < sites.size(); ++i) {
+            const LogSiteStats &st = sites[i];
+            LogMsg *msg = this->_make_notice(ALOG_LVL_INFO, 0,
+                "[AsyncLogger] top site #%u %s:%d %.1f hits/s %.0f bytes/s %lu drops in %.1fs",
+                (unsigned)(i + 1), st.site->file, st.site->line, st.hits / secs, st.bytes / secs,
+                (unsigned long)st.drops, secs);
+            if (msg != NULL) {
+                this->psink->sink(msg);
+            }
+        }
+    }
+
+    inline void AsyncLogger::_publish_shm(bool stopped) {
+        ShmStatsPage *page = this->shm_page;
+        if (page == NULL) {
+            return;
+        }
+
+        size_t capacity = 0;
+        size_t write_pos = 0;
+        size_t read_pos = 0;
+        if (this->queue_mode == QUEUE_RING) {
+            capacity = this->ring.capacity();
+            write_pos = this->ring.write_pos();
+            read_pos = this->ring.read_pos();
+        } else if (this->queue_mode == QUEUE_SPSC) {
+            for (_ThreadQueue *tq = this->thread_queues.load(turf::Acquire); tq != NULL; tq = tq->next) {
+                capacity += tq->q.capacity();
+            }
+        } else {
+            _LogQueue *lq = this->qp.load(turf::Acquire);
+            capacity = lq->q.capacity();
+            write_pos = lq->q.write_pos();
+            read_pos = lq->q.read_pos();
+        }
+
+        // seqlock, readers retry while seq is odd or moved
+        uint64_t seq = page->seq.load(turf::Relaxed);
+        page->seq.store(seq + 1, turf::Relaxed);
+        turf::threadFenceRelease();
+
+        page->update_ns.store(_get_clock_nsec(CLOCK_REALTIME), turf::Relaxed);
+        page->stopped.store(stopped ? 1 : 0, turf::Relaxed);
+        page->level.store(this->level.load(turf::Relaxed), turf::Relaxed);
+        page->queue_mode.store(this->queue_mode, turf::Relaxed);
+        page->queue_capacity.store(capacity, turf::Relaxed);
+        page->queue_depth.store(this->_queue_depth(), turf::Relaxed);
+        page->queue_write_pos.store(write_pos, turf::Relaxed);
+        page->queue_read_pos.store(read_pos, turf::Relaxed);
+
+        Stats &st = this->stats;
+        page->total.store(st.total.load(turf::Relaxed), turf::Relaxed);
+        page->drop.store(st.drop.load(turf::Relaxed), turf::Relaxed);
+        page->err.store(st.err.load(turf::Relaxed), turf::Relaxed);
+        page->trunc.store(st.trunc.load(turf::Relaxed), turf::Relaxed);
+        page->chunked.store(st.chunked.load(turf::Relaxed), turf::Relaxed);
+        page->shed.store(st.shed.load(turf::Relaxed), turf::Relaxed);
+        page->coalesced.store(st.coalesced.load(turf::Relaxed), turf::Relaxed);
+        page->blocked.store(st.blocked.load(turf::Relaxed), turf::Relaxed);
+        page->blocked_us.store(st.blocked_us.load(turf::Relaxed), turf::Relaxed);
+        page->block_timeout.store(st.block_timeout.load(turf::Relaxed), turf::Relaxed);
+        page->resize.store(st.resize.load(turf::Relaxed), turf::Relaxed);
+        page->budget_full.store(st.budget_full.load(turf::Relaxed), turf::Relaxed);
+        page->inflight_bytes.store(st.inflight_bytes.load(turf::Relaxed), turf::Relaxed);
+        page->inflight_peak.store(st.inflight_peak.load(turf::Relaxed), turf::Relaxed);
+        page->pool_bytes.store(st.pool_bytes.load(turf::Relaxed), turf::Relaxed);
+        page->write_bytes.store(this->metrics.write_bytes.load(turf::Relaxed), turf::Relaxed);
+        for (size_t i = 0; i < ALOG_LVL_MAX && i < 8; ++i) {
+            page->drop_level[i].store(st.drop_level[i].load(turf::Relaxed), turf::Relaxed);
+        }
+
+        turf::threadFenceRelease();
+        page->seq.store(seq + 2, turf::Relaxed);
+    }
+
+    // the priority lane goes first, order between lanes is left to seq and time_ns
+    inline size_t AsyncLogger::_pop_bulk(LogMsg **out, size_t max) {
+        size_t n = 0;
+        if (this->prio_level < ALOG_LVL_MAX) {
+            n = this->prio_q.try_pop_bulk_single(out, max);
+            if (n == max) {
+                return n;
+            }
+        }
+        if (this->queue_mode == QUEUE_RING) {
+            return n + this->_pop_ring_bulk(out + n, max - n);
+        } else if (this->queue_mode == QUEUE_SPSC) {
+            return n + this->_pop_thread_queues_bulk(out + n, max - n);
+        }
+        // msgs pushed before a resize come first
+        for (_LogQueue *lq = this->retired_queues.load(turf::Acquire); lq != NULL && n < max; lq = lq->retired_next) {
+            if (lq->q.size_approx() != 0) {
+                n += lq->q.try_pop_bulk_single(out + n, max - n);
+            }
+        }
+        return n + this->qp.load(turf::Acquire)->q.try_pop_bulk_single(out + n, max - n);
+    }
+
+    // joins chunks of long msgs. returns the msgs to sink and their count in n, batch if nothing is chunked.
+    inline LogMsg **AsyncLogger::_join_chunks(LogMsg **batch, size_t &n) {
+        if (this->chunked.empty()) {
+            size_t i = 0;
+            while (i < n && (batch[i]->type != MSGTYPE_LOG || !(batch[i]->flags & (MSGFLAG_MORE | MSGFLAG_CONT)))) {
+                ++i;
+            }
+            if (i == n) {
+                return batch;   // nothing chunked
+            }
+        }
+
+        // a partial msg may be delivered ahead of the current one, so output can outgrow batch
+        std::vector<LogMsg *> &out = this->joined;
+        out.clear();
+        for (size_t i = 0; i < n; ++i) {
+            LogMsg *msg = batch[i];
+            if (msg->type != MSGTYPE_LOG
+                || (this->chunked.empty() && !(msg->flags & (MSGFLAG_MORE | MSGFLAG_CONT))))
+            {
+                out.push_back(msg);
+                continue;
+            }
+
+            bool prio = msg->level >= this->prio_level;
+            size_t k = 0;
+            while (k < this->chunked.size() && (this->chunked[k].tid != msg->tid || this->chunked[k].prio != prio)) {
+                ++k;
+            }
+            if (k < this->chunked.size() && !(msg->flags & MSGFLAG_CONT)) {
+                // same thread and lane, so the producer gave up on the rest. deliver what was joined
+                this->stats.trunc.fetchAdd(1, turf::Relaxed);
+                out.push_back(this->chunked[k].msg);
+                this->chunked[k] = this->chunked.back();
+                this->chunked.pop_back();
+                k = this->chunked.size();
+            }
+
+            if (k == this->chunked.size()) {
+                if (!(msg->flags & MSGFLAG_MORE)) {
+                    out.push_back(msg);     // not chunked, or the first chunk was dropped
+                    continue;
+                }
+                // first chunk
+                _Chunked c;
+                c.tid = msg->tid;
+                c.prio = prio;
+                c.cap = msg->msg_size * 4;
+                c.since_ms = _get_time_msec();
+                c.msg = (LogMsg *)::malloc(sizeof(LogMsg) + c.cap);
+                if (c.msg == NULL) {
+                    out.push_back(msg);     // deliver chunks as they are
+                    continue;
+                }
+                ::memcpy(c.msg, msg, sizeof(LogMsg) + msg->msg_size);
+                c.msg->flags = MSGFLAG_HEAP;
+                this->chunked.push_back(c);
+                this->recycle(msg);
+                continue;
+            }
+
+            _Chunked &c = this->chunked[k];
+            size_t need = c.msg->msg_size + msg->msg_size;
+            if (need > c.cap) {
+                size_t cap = c.cap * 2 > need ? c.cap * 2 : need;
+                LogMsg *grown = (LogMsg *)::realloc(c.msg, sizeof(LogMsg) + cap);
+                if (grown == NULL) {
+                    this->stats.trunc.fetchAdd(1, turf::Relaxed);
+                    out.push_back(c.msg);
+                    this->recycle(msg);
+                    c = this->chunked.back();
+                    this->chunked.pop_back();
+                    continue;
+                }
+                c.msg = grown;
+                c.cap = cap;
+            }
+            ::memcpy(c.msg->msg_data + c.msg->msg_size, msg->msg_data, msg->msg_size);
+            c.msg->msg_size = need;
+
+            bool last = !(msg->flags & MSGFLAG_MORE);
+            this->recycle(msg);
+            if (last) {
+                out.push_back(c.msg);
+                c = this->chunked.back();
+                this->chunked.pop_back();
+            }
+        }
+        n = out.size();
+        return n != 0 ? &out[0] : batch;
+    }
+
+    // deliver msgs whose last chunk never came, all or those waiting longer than flush_interval_ms
+    inline void AsyncLogger::_flush_chunks(bool all) {
+        if (this->chunked.empty()) {
+            return;
+        }
+        uint64_t now = _get_time_msec();
+        size_t i = 0;
+        while (i < this->chunked.size()) {
+            if (!all && now < this->chunked[i].since_ms + this->flush_interval_ms) {
+                ++i;
+                continue;
+            }
+            this->stats.trunc.fetchAdd(1, turf::Relaxed);
+            this->psink->sink(this->chunked[i].msg);
+            this->chunked[i] = this->chunked.back();
+            this->chunked.pop_back();
+        }
+    }
+
+    // a msg made by the consumer, recycle() frees it
+    inline LogMsg *AsyncLogger::_make_notice(LevelType level, uint64_t seq, const char *fmt, ...) {
+        char buf[256];
+        va_list ap;
+        va_start(ap, fmt);
+        int n = TZ_ASYNCLOG_VSNPRINTF(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        size_t size = n < 0 ? 0 : ((size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+
+        LogMsg *msg = (LogMsg *)::malloc(sizeof(LogMsg) + size);
+        if (msg == NULL) {
+            return NULL;
+        }
+        msg->type = MSGTYPE_LOG;
+        msg->level = level;
+        msg->flags = MSGFLAG_HEAP;
+        msg->time_ns = _get_clock_nsec(CLOCK_REALTIME);
+        msg->mono_ns = this->monotonic_stamp ? _get_clock_nsec(CLOCK_MONOTONIC) : 0;
+        msg->tid = this->get_tid();
+        msg->site = NULL;
+        msg->seq = seq;
+        msg->msg_size = size;
+        ::memcpy(msg->msg_data, buf, size);
+        return msg;
+    }
+
+    // tell the sink that msgs went missing, seqs of dropped msgs fall in the reported range
+    inline void AsyncLogger::_mark_drops() {
+        if (!this->drop_markers) {
+            return;
+        }
+
+        uint64_t shed = this->stats.shed.load(turf::Relaxed);
+        if (shed != this->marked_shed) {
+            LogMsg *msg = this->_make_notice(ALOG_LVL_WARN, 0,
+                "[AsyncLogger] shed %lu low level messages under load",
+                (unsigned long)(shed - this->marked_shed));
+            if (msg != NULL) {
+                this->marked_shed = shed;
+                this->psink->sink(msg);
+            }
+        }
+
+        uint64_t drop = this->stats.drop.load(turf::Relaxed);
+        if (drop == this->marked_drop) {
+            return;
+        }
+        uint64_t seq = this->stats.total.load(turf::Relaxed);
+        seq = seq > 0 ? seq - 1 : 0;
+        LogMsg *msg = this->_make_notice(ALOG_LVL_WARN, seq,
+            "[AsyncLogger] dropped %lu messages between seq %lu and %lu",
+            (unsigned long)(drop - this->marked_drop), (unsigned long)this->marked_seq, (unsigned long)seq);
+        if (msg == NULL) {
+            return;     // try again later
+        }
+        this->marked_drop = drop;
+        this->marked_seq = seq;
+        this->psink->sink(msg);
+    }
+
+    // fnv-1a
+    inline uint64_t _hash_bytes(uint64_t h, const void *data, size_t size) {
+        const unsigned char *p = (const unsigned char *)data;
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ p[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    inline uint64_t _hash_msg(const LogMsg *msg) {
+        uint64_t h = 14695981039346656037ull;
+        h = _hash_bytes(h, &msg->flags, sizeof(msg->flags));
+        if (msg->flags & MSGFLAG_LITERAL) {
+            h = _hash_bytes(h, &msg->site, sizeof(msg->site));
+        }
+        return _hash_bytes(h, msg->msg_data, msg->msg_size);
+    }
+
+    inline LogMsg *AsyncLogger::_make_repeat_notice(_Repeat &r) {
+        LogMsg *msg = this->_make_notice(r.level, r.seq, "last message repeated %u times", r.count);
+        if (msg != NULL) {
+            msg->tid = r.tid;
+            msg->time_ns = r.last_ns;
+        }
+        r.count = 0;
+        return msg;
+    }
+
+    // drops repeats from a run of log msgs, the rest and repeat notices go to coalesced
+    inline size_t AsyncLogger::_coalesce(LogMsg **msgs, size_t n) {
+        const size_t k_slots = 256;
+        if (this->repeats.empty()) {
+            _Repeat empty = {};
+            this->repeats.resize(k_slots, empty);
+        }
+        uint64_t window_ns = (uint64_t)this->coalesce_window_ms * 1000000;
+
+        this->coalesced.clear();
+        for (size_t i = 0; i < n; ++i) {
+            LogMsg *msg = msgs[i];
+            uint64_t hash = _hash_msg(msg);
+            _Repeat &r = this->repeats[(size_t)msg->tid % k_slots];
+            if (r.tid == msg->tid && r.hash == hash && r.level == msg->level && r.flags == msg->flags
+                && r.site == msg->site && r.data.size() == msg->msg_size
+                && ::memcmp(r.data.data(), msg->msg_data, msg->msg_size) == 0)
+            {
+                if (r.count++ == 0) {
+                    r.first_ns = msg->time_ns;
+                }
+                r.last_ns = msg->time_ns;
+                r.seq = msg->seq;
+                this->recycle(msg);
+                this->stats.coalesced.fetchAdd(1, turf::Relaxed);
+                if (r.last_ns >= r.first_ns + window_ns) {
+                    LogMsg *notice = this->_make_repeat_notice(r);
+                    if (notice != NULL) {
+                        this->coalesced.push_back(notice);
+                    }
+                }
+                continue;
+            }
+
+            if (r.tid != 0 && r.count != 0) {
+                // run ended, or another thread takes the slot
+                LogMsg *notice = this->_make_repeat_notice(r);
+                if (notice != NULL) {
+                    this->coalesced.push_back(notice);
+                }
+            }
+            r.tid = msg->tid;
+            r.level = msg->level;
+            r.flags = msg->flags;
+            r.site = msg->site;
+            r.hash = hash;
+            r.data.assign(msg->msg_data, msg->msg_size);
+            r.count = 0;
+            this->coalesced.push_back(msg);
+        }
+        return this->coalesced.size();
+    }
+
+    // report runs older than the window, or all of them
+    inline void AsyncLogger::_flush_repeats(bool all) {
+        uint64_t now = _get_clock_nsec(CLOCK_REALTIME);
+        uint64_t window_ns = (uint64_t)this->coalesce_window_ms * 1000000;
+        for (size_t i = 0; i < this->repeats.size(); ++i) {
+            _Repeat &r = this->repeats[i];
+            if (r.count != 0 && (all || now >= r.first_ns + window_ns)) {
+                LogMsg *notice = this->_make_repeat_notice(r);
+                if (notice != NULL) {
+                    this->psink->sink(notice);
+                }
+            }
+        }
+    }
+
+    inline void AsyncLogger::_consumer_exit() {
+        // nobody will make room anymore, release blocked producers
+        this->consumer_running.store(0, turf::Release);
+        this->space_waiters.notify_all();
+    }
+
+    inline void *AsyncLogger::_consumer(void *arg) {
+        AsyncLogger *logger = (AsyncLogger *)arg;
+        ILogSink *sink = logger->psink.get();
+        assert(sink != NULL);
+
+        const size_t k_max_batch = 256;
+        LogMsg *batch[k_max_batch];
+        uint64_t stamps[k_max_batch];   // time_ns of a run, for metrics
+        size_t batch_size = logger->batch_size;
+        if (batch_size == 0 || batch_size > k_max_batch) {
+            batch_size = k_max_batch;
+        }
+
+        size_t attempts = 0;
+        uint64_t last_flush = _get_time_msec();
+        bool stopping = false;
+        while (true) {
+            size_t n = stopping ? logger->_pop_stop_left(batch, batch_size) : logger->_pop_bulk(batch, batch_size);
+            if (n == 0) {
+                if (stopping) {
+                    logger->_flush_repeats(true);
+                    logger->_flush_chunks(true);
+                    logger->_collect_shed();
+                    logger->_mark_drops();
+                    logger->_flush_sink();
+                    sink->close();
+                    logger->_update_pool_stats();
+                    logger->_export_metrics(_get_time_msec(), true);
+                    logger->_publish_shm(true);
+                    logger->_consumer_exit();
+                    return NULL;    // thread exit
+                }
+
+                // queue empty, wait a moment
+                bool sleeped = false;
+                if (logger->wait_mode == WAIT_PARK) {
+                    if (++attempts < logger->spin_count) {
+                        continue;   // spin
+                    }
+                    if (logger->consumer_parked.load(turf::Relaxed) == 0) {
+                        // announce, then check the queue once more before parking
+                        logger->consumer_parked.store(1, turf::Relaxed);
+                        turf::threadFenceSeqCst();
+                        continue;
+                    }
+                    logger->wakeup.wait((int)logger->flush_interval_ms);
+                    logger->consumer_parked.store(0, turf::Relaxed);
+                    sleeped = true;
+                } else {
+                    sleeped = _wait_a_moment(++attempts, logger->spin_count);
+                }
+                if (sleeped) {
+                    if (logger->overflow_policy != OVERFLOW_DROP) {
+                        logger->space_waiters.notify_all();     // in case a wakeup was missed
+                    }
+                    logger->_update_pressure();
+                    logger->_flush_repeats(false);
+                    logger->_flush_chunks(false);
+                    logger->_mark_drops();
+                    if (logger->queue_mode == QUEUE_SPSC) {
+                        logger->_reap_thread_queues();
+                    }
+                    // give idle blocks back to producers
+                    logger->_update_pool_stats();
+                    // check for flush
+                    uint64_t now = _get_time_msec();
+                    if (now >= last_flush + logger->flush_interval_ms) {
+                        last_flush = now;
+                        logger->_collect_shed();
+                        logger->_report_sites(now);
+                        logger->_flush_sink();
+                        logger->_export_metrics(now, false);
+                        logger->_publish_shm(false);
+                    }
+                    if (logger->metrics_enabled) {
+                        logger->_record_depth(0);
+                        logger->_rotate_metrics(now * 1000000);
+                    }
+                }
+                // retry
+                continue;
+            }
+
+            attempts = 0;
+            logger->_update_pressure();
+            if (logger->metrics_enabled) {
+                logger->_record_depth(n);
+            }
+            if (logger->consumer_parked.load(turf::Relaxed) != 0) {
+                logger->consumer_parked.store(0, turf::Relaxed);    // found msgs after announcing
+            }
+            if (logger->clock_source == CLOCKSRC_TSC) {
+                logger->_convert_tsc(batch, n);
+            }
+            LogMsg **msgs = logger->_join_chunks(batch, n);
+            size_t i = 0;
+            while (i < n) {
+                // hand consecutive log msgs to sink in one call
+                size_t j = i;
+                while (j < n && j - i < k_max_batch && msgs[j]->type == MSGTYPE_LOG) {
+                    ++j;    // joined msgs may outnumber the batch, stamps holds k_max_batch
+                }
+                if (j > i) {
+                    // check for flush before msgs are deleted
+                    uint64_t msec = msgs[j - 1]->time_ns / 1000000;
+                    uint64_t begin_ns = 0;
+                    if (logger->metrics_enabled) {
+                        for (size_t k = i; k < j; ++k) {
+                            stamps[k - i] = msgs[k]->time_ns;
+                        }
+                    }
+                    LogMsg **out = &msgs[i];
+                    size_t m = j - i;
+                    if (logger->coalesce_window_ms != 0) {
+                        m = logger->_coalesce(&msgs[i], j - i);
+                        out = m != 0 ? &logger->coalesced[0] : NULL;
+                    }
+                    if (logger->metrics_enabled) {
+                        // repeats folded by _coalesce() are not written
+                        for (size_t k = 0; k < m; ++k) {
+                            LevelType level = out[k]->level;
+                            _consumer_add(logger->metrics.written[level < ALOG_LVL_MAX ? level : 0], 1);
+                        }
+                        begin_ns = _get_clock_nsec(CLOCK_MONOTONIC);
+                    }
+                    if (m != 0) {
+                        sink->sink_batch(out, m);   // msgs moved to sink
+                    }
+                    if (logger->metrics_enabled) {
+                        logger->_record_sink(stamps, j - i, begin_ns);
+                    }
+                    if (msec >= last_flush + logger->flush_interval_ms) {
+                        last_flush = msec;
+                        logger->_flush_repeats(false);   // a busy consumer never idles
+                        logger->_collect_shed();
+                        logger->_report_sites(msec);
+                        logger->_flush_sink();
+                        logger->_export_metrics(msec, false);
+                        logger->_publish_shm(false);
+                        logger->_update_pool_stats();
+                    }
+                    i = j;
+                    continue;
+                }
+
+                LogMsg *msg = msgs[i++];
+                switch (msg->type) {
+                case MSGTYPE_STOP:
+                    logger->recycle(msg);
+                    // finish this batch. with QUEUE_SPSC drain what the other rings hold now too.
+                    if (!stopping && logger->queue_mode == QUEUE_SPSC) {
+                        logger->_mark_stop_left();
+                    }
+                    stopping = true;
+                    break;
+                case MSGTYPE_FLUSH:
+                    logger->recycle(msg);
+                    last_flush = _get_time_msec();
+                    logger->_flush_sink();
+                    break;
+                default:
+                    assert(!"unknown MSGTYPE");
+                }
+            }
+
+            if (logger->overflow_policy != OVERFLOW_DROP) {
+                logger->space_waiters.notify_all();
+            }
+            logger->_mark_drops();
+
+            if (stopping && logger->queue_mode != QUEUE_SPSC) {
+                logger->_flush_repeats(true);
+                logger->_flush_chunks(true);
+                logger->_collect_shed();
+                logger->_mark_drops();
+                logger->_flush_sink();
+                sink->close();
+                logger->_update_pool_stats();
+                logger->_export_metrics(_get_time_msec(), true);
+                logger->_publish_shm(true);
+                logger->_consumer_exit();
+                return NULL;    // thread exit
+            }
+        }   // while true
+    }
+
+    inline const char *_internal_log_level_string(LevelType level) {
+        switch (level) {
+#define _INTERNAL_LOG_LEVEL_CASE(lvl) case lvl: return #lvl
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_DEBUG);
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_INFO);
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_NOTICE);
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_WARN);
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_ERROR);
+        _INTERNAL_LOG_LEVEL_CASE(ALOG_LVL_FATAL);
+#undef _INTERNAL_LOG_LEVEL_CASE
+        default: return "ALOG_LVL_UNKNOWN";
+        }
+    }
+
+    inline void AsyncLogger::_internal_log(LevelType level, const char *fmt, ...) {
+        if (this->internal_logfile == NULL) {
+            return;
         }
 
         time_t now = ::time(NULL);
@@ -370,53 +2296,465 @@ namespace tz { namespace asynclog {
     inline void AsyncLogger::log(LevelType level, const char *fmt, ...) {
         va_list ap;
         va_start(ap, fmt);
-        this->vlog(level, fmt, ap);
+        this->vlog_site(NULL, level, fmt, ap);
+        va_end(ap);
+    }
+
+    inline void AsyncLogger::log_site(const LogSite *site, LevelType level, const char *fmt, ...) {
+        va_list ap;
+        va_start(ap, fmt);
+        this->vlog_site(site, level, fmt, ap);
         va_end(ap);
     }
 
+    // payload writers for AsyncLogger::_log(). write() fills size bytes, it may shrink size,
+    // or set a larger size and return false to get a bigger msg.
+
+    // copies bytes as is
+    struct _BinArgs {
+        const LogSite *site;
+        const char *data;
+        size_t size;
+        uint8_t flags;
+
+        _BinArgs(const LogSite *site, const char *data, size_t size)
+            : site(site), data(data), size(size), flags(0)
+        {}
+
+        bool write(char *dst) {
+            ::memcpy(dst, this->data, this->size);
+            return true;
+        }
+    };
+
+    // msg refers to the site's fmt
+    struct _LiteralArgs {
+        const LogSite *site;
+        size_t size;
+        uint8_t flags;
+
+        explicit _LiteralArgs(const LogSite *site)
+            : site(site), size(0), flags(MSGFLAG_LITERAL)
+        {}
+
+        bool write(char *) {
+            return true;
+        }
+    };
+
+    // vsnprintf straight into the msg. the msg is sized from the site's last output,
+    // and made again with the exact size if that was too small.
+    // output longer than limit is formatted on heap, write() puts the first chunk.
+    struct _FormatArgs {
+        const LogSite *site;
+        const char *fmt;
+        va_list ap;
+        size_t size;
+        uint8_t flags;
+        size_t limit;   // format_buffer_size
+        char *big;      // whole output if longer than limit
+        size_t big_size;
+        bool exact;     // size is known to fit
+        bool trunc;
+        bool err;
+
+        _FormatArgs(const LogSite *site, const char *fmt, va_list ap, size_t limit)
+            : site(site), fmt(fmt), size(0), flags(0), limit(limit)
+            , big(NULL), big_size(0), exact(false), trunc(false), err(false)
+        {
+            va_copy(this->ap, ap);
+            const size_t k_default_size = 256;
+            size_t hint = site ? site->state->size_hint.load(turf::Relaxed) : 0;
+            this->size = hint != 0 ? hint : k_default_size;
+            if (this->size > limit) {
+                this->size = limit;
+            }
+        }
+
+        ~_FormatArgs() {
+            va_end(this->ap);
+            ::free(this->big);
+        }
+
+        bool write(char *dst) {
+            if (this->big != NULL) {
+                ::memcpy(dst, this->big, this->size);
+                return true;
+            }
+
+            va_list tmp;
+            va_copy(tmp, this->ap);
+            int n = TZ_ASYNCLOG_VSNPRINTF(dst, this->size, this->fmt, tmp);
+            va_end(tmp);
+            if (n >= 0 && (size_t)n + 1 >= this->size && !this->exact) {
+                // buffer filled. stb_sprintf returns the truncated length, measure the whole output.
+                va_copy(tmp, this->ap);
+                n = TZ_ASYNCLOG_VSNPRINTF(NULL, 0, this->fmt, tmp);
+                va_end(tmp);
+            }
+
+            if (n < 0) {
+                this->err = true;
+                const char *errmsg = "[AsyncLogger] bad vsnprintf call";
+                size_t len = ::strlen(errmsg);
+                this->size = len < this->size ? len : this->size;
+                ::memcpy(dst, errmsg, this->size);
+                return true;
+            }
+            if ((size_t)n < this->size) {
+                this->size = (size_t)n;     // shrink
+                return true;
+            }
+
+            // leave some room, a filled buffer costs a measuring pass
+            size_t hint = (size_t)n + 1 + (size_t)n / 4;
+            if (this->site != NULL) {
+                this->site->state->size_hint.store((uint32_t)(hint < this->limit ? hint : this->limit), turf::Relaxed);
+            }
+            if ((size_t)n < this->limit) {
+                this->size = (size_t)n + 1;     // too small, try again with exact size
+                this->exact = true;
+                return false;
+            }
+
+            // long msg, split into chunks
+            this->big = (char *)::malloc((size_t)n + 1);
+            if (this->big == NULL) {
+                this->trunc = true;
+                this->size -= 1;            // vsnprintf wrote a NUL in the last byte
+                return true;
+            }
+            va_copy(tmp, this->ap);
+            TZ_ASYNCLOG_VSNPRINTF(this->big, (size_t)n + 1, this->fmt, tmp);
+            va_end(tmp);
+            this->big_size = (size_t)n;
+            this->flags = this->big_size > this->limit ? MSGFLAG_MORE : 0;
+            if (this->size < this->limit) {
+                this->size = this->limit;
+                return false;
+            }
+            this->size = this->limit;
+            return this->write(dst);
+        }
+
+    private:
+        _FormatArgs(const _FormatArgs &);
+        _FormatArgs &operator=(const _FormatArgs &);
+    };
+
+    inline void AsyncLogger::log_literal(const LogSite *site, LevelType level) {
+        assert(site->state->literal);
+        _LiteralArgs w(site);
+        this->_log(level, w);
+    }
+
     inline void AsyncLogger::vlog(LevelType level, const char *fmt, va_list ap) {
-        char buf[this->format_buffer_size];     // NOTE: stack overflow
-        int n = TZ_ASYNCLOG_VSNPRINTF(buf, sizeof(buf), fmt, ap);
+        this->vlog_site(NULL, level, fmt, ap);
+    }
 
-        const char *msgdata = NULL;
-        size_t msgsize = 0;
-        if (n > 0) {
-            msgdata = buf;
-            msgsize = (size_t)n;
-            if (msgsize >= sizeof(buf)) {
-                msgsize = sizeof(buf) - 1;
-                this->stats.trunc.fetchAdd(1, turf::Relaxed);
+    inline void AsyncLogger::vlog_site(const LogSite *site, LevelType level, const char *fmt, va_list ap) {
+        if (this->deferred_format) {
+            _DeferredArgs args(site, fmt, _get_site_plan(site, fmt), ap, MSGFLAG_DEFERRED);
+            if (args.size != 0 && args.size <= this->format_buffer_size) {
+                this->_log(level, args);
+                return;
             }
-        } else {
-            this->stats.err.fetchAdd(1, turf::Relaxed);
-            const char *errmsg = "[AsyncLogger] bad vsnprintf call";
-            msgdata = errmsg;
-            msgsize = strlen(errmsg);
+            // fmt not supported or args too large, format now
         }
 
-        return this->binlog(level, msgdata, msgsize);
+        _FormatArgs w(site, fmt, ap, this->format_buffer_size);
+        uint64_t seq = 0;
+        bool ok = this->_log(level, w, &seq);
+        if (w.big != NULL) {
+            this->stats.chunked.fetchAdd(1, turf::Relaxed);
+            if (ok) {
+                this->_log_chunks(site, level, seq, w.big + w.size, w.big_size - w.size);
+            }
+        }
+        if (w.trunc) {
+            this->stats.trunc.fetchAdd(1, turf::Relaxed);
+        }
+        if (w.err) {
+            this->stats.err.fetchAdd(1, turf::Relaxed);
+        }
     }
 
-    inline void AsyncLogger::binlog(LevelType level, const char *data, size_t size) {
-        LogMsg *msg = this->create(size);
+    template <class Writer>
+    inline LogMsg *AsyncLogger::_make_msg(LevelType level, uint64_t seq, Writer &w) {
+        size_t reserved = w.size;
+        LogMsg *msg = this->_create(reserved, level);
+        if (msg == NULL) {
+            return NULL;
+        }
+        if (!w.write(msg->msg_data)) {
+            // payload larger than reserved, w.size is exact now
+            this->_discard(msg);
+            reserved = w.size;
+            msg = this->_create(reserved, level);
+            if (msg == NULL) {
+                return NULL;
+            }
+            bool ok = w.write(msg->msg_data);
+            assert(ok);
+            (void)ok;
+        }
+        if (w.size < reserved) {
+            if (this->queue_mode == QUEUE_RING && !(msg->flags & MSGFLAG_HEAP)) {
+                mpsc_byte_ring::shrink(msg, sizeof(LogMsg) + w.size);
+            }
+            if (msg->flags & MSGFLAG_BUDGET) {
+                this->stats.inflight_bytes.fetchSub(reserved - w.size, turf::Relaxed);
+            }
+        }
+
         msg->type = MSGTYPE_LOG;
         msg->level = level;
-        ::gettimeofday(&msg->time, NULL);
+        msg->flags = w.flags | (msg->flags & (MSGFLAG_HEAP | MSGFLAG_BUDGET));
+        this->_stamp(msg);
         msg->tid = this->get_tid();
-        ::memcpy(msg->msg_data, data, size);
-        msg->msg_size = size;
+        msg->site = w.site;
+        msg->seq = seq;
+        msg->msg_size = w.size;
+        return msg;
+    }
 
-        if (!this->sink(msg)) {
-            this->recycle(msg);
+    template <class Writer>
+    inline bool AsyncLogger::_try_enqueue(LogMsg *&msg, LevelType level, uint64_t seq, Writer &w) {
+        if (msg == NULL) {
+            msg = this->_make_msg(level, seq, w);
+            if (msg == NULL) {
+                return false;
+            }
+        }
+        return this->sink(msg);
+    }
+
+    template <class Writer>
+    inline bool AsyncLogger::_enqueue_blocking(LogMsg *&msg, LevelType level, uint64_t seq, Writer &w) {
+        uint64_t begin_us = _get_monotonic_usec();
+        this->stats.blocked.fetchAdd(1, turf::Relaxed);
+
+        bool ok = false;
+        for (size_t i = 0; i < this->spin_count && !ok; ++i) {
+            ::sched_yield();
+            ok = this->_try_enqueue(msg, level, seq, w);
+        }
+
+        if (!ok) {
+            timespec deadline = {0, 0};
+            timespec *pdeadline = NULL;
+            if (this->overflow_policy == OVERFLOW_BLOCK_TIMEOUT) {
+                uint64_t until_us = begin_us + (uint64_t)this->overflow_timeout_ms * 1000;
+                deadline.tv_sec = until_us / 1000000;
+                deadline.tv_nsec = (long)(until_us % 1000000) * 1000;
+                pdeadline = &deadline;
+            }
+
+            this->space_waiters.enter();
+            while (!(ok = this->_try_enqueue(msg, level, seq, w))) {
+                if (!this->consumer_running.load(turf::Acquire)) {
+                    break;
+                }
+                if (!this->space_waiters.wait(pdeadline)) {
+                    ok = this->_try_enqueue(msg, level, seq, w);
+                    if (!ok) {
+                        this->stats.block_timeout.fetchAdd(1, turf::Relaxed);
+                    }
+                    break;
+                }
+            }
+            this->space_waiters.leave();
+        }
+
+        this->stats.blocked_us.fetchAdd(_get_monotonic_usec() - begin_us, turf::Relaxed);
+        return ok;
+    }
+
+    // continuation chunks of a long msg, stops at the first dropped one.
+    // chunks share seq of the first one, the msg is counted once in stats.total.
+    inline void AsyncLogger::_log_chunks(const LogSite *site, LevelType level, uint64_t seq,
+        const char *data, size_t size)
+    {
+        while (size > 0) {
+            size_t len = size < this->format_buffer_size ? size : this->format_buffer_size;
+            _BinArgs w(site, data, len);
+            w.flags = MSGFLAG_CONT | (len < size ? MSGFLAG_MORE : 0);
+            if (!this->_enqueue(level, seq, w)) {
+                return;     // consumer delivers the joined part as truncated
+            }
+            if (this->site_stats && site != NULL) {
+                _count_site(site, this->get_tid(), 0, len, 0);
+            }
+            data += len;
+            size -= len;
+        }
+    }
+
+    template <class Writer>
+    inline bool AsyncLogger::_log(LevelType level, Writer &w, uint64_t *pseq) {
+        // total doubles as the sequence counter, no extra atomic op
+        uint64_t seq = this->stats.total.fetchAdd(1, turf::Relaxed);
+        if (pseq != NULL) {
+            *pseq = seq;
+        }
+        bool ok = this->_enqueue(level, seq, w);
+
+        if (this->site_stats && w.site != NULL) {
+            // a literal msg carries no payload, count its fmt
+            uint64_t bytes = w.size != 0 ? w.size : w.site->state->literal_size;
+            _count_site(w.site, this->get_tid(), 1, ok ? bytes : 0, ok ? 0 : 1);
+        }
+
+        if (!ok) {
             this->stats.drop.fetchAdd(1, turf::Relaxed);
+            this->stats.drop_level[level < ALOG_LVL_MAX ? level : 0].fetchAdd(1, turf::Relaxed);
+        }
+        return ok;
+    }
+
+    // makes and queues a msg of seq, false if it was dropped
+    template <class Writer>
+    inline bool AsyncLogger::_enqueue(LevelType level, uint64_t seq, Writer &w) {
+        LogMsg *msg = this->_make_msg(level, seq, w);
+        bool ok = msg != NULL && this->sink(msg);
+        if (!ok && this->overflow_policy != OVERFLOW_DROP && (msg != NULL || this->_may_fit(w.size, level))) {
+            ok = this->_enqueue_blocking(msg, level, seq, w);
+        }
+        if (!ok && msg != NULL) {
+            // with QUEUE_RING a created msg is committed or on heap, so msg is not a reserved record here
+            this->recycle(msg);
+        }
+        return ok;
+    }
+
+    inline void AsyncLogger::binlog(LevelType level, const char *data, size_t size) {
+        _BinArgs w(NULL, data, size);
+        this->_log(level, w);
+    }
+
+    // token bucket of a TZ_ASYNC_LOG_RATELIMITED call site
+    struct _RateLimiter {
+        uint32_t rate;      // tokens per second
+        uint32_t burst;
+        turf::Atomic<uint64_t> refill_ms;   // coarse monotonic time the tokens are counted up to
+        turf::Atomic<uint32_t> tokens;
+        turf::Atomic<uint64_t> suppressed;  // calls skipped since the last allowed one
+
+        _RateLimiter(uint32_t rate, uint32_t burst)
+            : rate(rate), burst(burst), refill_ms(0), tokens(burst), suppressed(0)
+        {}
+
+        // false if out of tokens, else suppressed is set to the calls skipped before this one
+        bool acquire(uint64_t &suppressed) {
+            this->refill();
+            uint32_t tokens = this->tokens.load(turf::Relaxed);
+            do {
+                if (tokens == 0) {
+                    this->suppressed.fetchAdd(1, turf::Relaxed);
+                    return false;
+                }
+            } while (!this->tokens.compareExchangeWeak(tokens, tokens - 1, turf::Relaxed, turf::Relaxed));
+
+            suppressed = 0;
+            if (this->suppressed.load(turf::Relaxed) != 0) {
+                suppressed = this->suppressed.exchange(0, turf::Relaxed);
+            }
+            return true;
+        }
+
+        void refill() {
+            if (this->rate == 0) {
+                return;
+            }
+            uint64_t now = _get_clock_nsec(TZ_ASYNCLOG_CLOCK_MONOTONIC_COARSE) / 1000000;
+            uint64_t last = this->refill_ms.load(turf::Relaxed);
+            uint64_t add = now > last ? (now - last) * this->rate / 1000 : 0;
+            if (add == 0) {
+                return;
+            }
+            // keep the fraction of a token for the next refill, unless the bucket is full anyway
+            uint64_t upto = add >= this->burst ? now : last + add * 1000 / this->rate;
+            if (!this->refill_ms.compareExchangeWeak(last, upto, turf::Relaxed, turf::Relaxed)) {
+                return;     // another thread refills
+            }
+            uint32_t tokens = this->tokens.load(turf::Relaxed);
+            uint32_t full;
+            do {
+                full = tokens + add < this->burst ? (uint32_t)(tokens + add) : this->burst;
+            } while (!this->tokens.compareExchangeWeak(tokens, full, turf::Relaxed, turf::Relaxed));
         }
-        this->stats.total.fetchAdd(1, turf::Relaxed);
+    };
+
+    // fmt kept by a LogSite. a const char array can not change, a mutable array or a pointer may,
+    // so the site knows nothing about those and they are formatted on every call.
+    template <size_t N>
+    inline const char *_site_fmt(const char (&fmt)[N]) {
+        return fmt;
+    }
+
+    template <size_t N>
+    inline const char *_site_fmt(char (&)[N]) {
+        return NULL;
+    }
+
+    template <class T>
+    inline const char *_site_fmt(T *const &) {
+        return NULL;
     }
 
+// 0 if called without args, 1 for 1 to 64 args
+#define _TZ_ALOG_HAS_ARGS(...) _TZ_ALOG_HAS_ARGS_(_, ##__VA_ARGS__, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    0, _)
+#define _TZ_ALOG_HAS_ARGS_( \
+    _0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, \
+    _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, \
+    _32, _33, _34, _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, \
+    _48, _49, _50, _51, _52, _53, _54, _55, _56, _57, _58, _59, _60, _61, _62, _63, \
+    _64, \
+    n, ...) n
+
+// each call site owns a static LogSite, registered once under the function static guard.
+// the site caches facts about fmt only if it is a literal or const char array, see _site_fmt().
+// such a fmt without args and conversion specs is logged by reference, without formatting.
+#define _TZ_ASYNC_LOG_SITE(logger, level, fmt, ...) \
+    do { \
+        static ::tz::asynclog::LogSite _tz_alog_site = \
+            { ::tz::asynclog::_site_fmt(fmt), __FILE__, __LINE__, __FUNCTION__, level, NULL, NULL }; \
+        static const bool _tz_alog_registered = ::tz::asynclog::_register_site(&_tz_alog_site); \
+        (void)_tz_alog_registered; \
+        if (_TZ_ALOG_HAS_ARGS(__VA_ARGS__) == 0 && _tz_alog_site.state->literal) \
+        { \
+            logger.log_literal(&_tz_alog_site, level); \
+        } else { \
+            logger.log_site(&_tz_alog_site, level, fmt, ##__VA_ARGS__); \
+        } \
+    } while (false)
+
 #define TZ_ASYNC_LOG(logger, level, fmt, ...) \
     do { \
         if (logger.should_log(level)) { \
-            logger.log(level, fmt, ##__VA_ARGS__); \
+            _TZ_ASYNC_LOG_SITE(logger, level, fmt, ##__VA_ARGS__); \
+        } \
+    } while (false)
+
+// at most rate msgs per second with bursts of burst msgs, other calls skip formatting.
+// the next allowed msg is preceded by a line counting the skipped ones.
+#define TZ_ASYNC_LOG_RATELIMITED(logger, level, rate, burst, fmt, ...) \
+    do { \
+        if (logger.should_log(level)) { \
+            static ::tz::asynclog::_RateLimiter _tz_alog_limiter(rate, burst); \
+            uint64_t _tz_alog_suppressed = 0; \
+            if (_tz_alog_limiter.acquire(_tz_alog_suppressed)) { \
+                if (_tz_alog_suppressed != 0) { \
+                    logger.log(level, "[AsyncLogger] suppressed %lu messages at %s:%d", \
+                        (unsigned long)_tz_alog_suppressed, __FILE__, __LINE__); \
+                } \
+                _TZ_ASYNC_LOG_SITE(logger, level, fmt, ##__VA_ARGS__); \
+            } \
         } \
     } while (false)
 
@@ -1,9 +1,18 @@
 #pragma once
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#if  __linux__
+#   include <sys/eventfd.h>
+#   include <poll.h>
+#endif
 #include <stdexcept>
 #include <sstream>
 
+#include <turf/Atomic.h>
+
 
 namespace tz { namespace asynclog {
 
@@ -55,4 +64,115 @@ namespace tz { namespace asynclog {
         }
     };
 
+    // wakeup channel for a parked thread. eventfd based, linux only.
+    struct _Event {
+        int fd;
+
+        _Event() : fd(-1) {}
+
+        ~_Event() {
+            this->close();
+        }
+
+        bool open() {
+#if  __linux__
+            if (this->fd < 0) {
+                this->fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            }
+#endif
+            return this->fd >= 0;
+        }
+
+        void close() {
+            if (this->fd >= 0) {
+                ::close(this->fd);  // ignore err
+                this->fd = -1;
+            }
+        }
+
+        void notify() {
+            uint64_t one = 1;
+            ssize_t rv = ::write(this->fd, &one, sizeof(one));
+            (void)rv;   // EAGAIN means already signaled
+        }
+
+        // returns false on timeout
+        bool wait(int timeout_ms) {
+#if  __linux__
+            struct pollfd pfd = { this->fd, POLLIN, 0 };
+            int rv = ::poll(&pfd, 1, timeout_ms);
+            if (rv <= 0) {
+                return false;
+            }
+            uint64_t cnt = 0;
+            rv = (int)::read(this->fd, &cnt, sizeof(cnt));     // reset
+            (void)rv;
+            return true;
+#else
+            (void)timeout_ms;
+            return false;
+#endif
+        }
+
+    private:
+        _Event(const _Event &);
+        _Event &operator=(const _Event &);
+    };
+
+    // threads blocked until another thread makes progress, e.g. producers on a full queue
+    struct _WaitQueue {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        turf::Atomic<uint32_t> waiters;
+
+        _WaitQueue() : waiters(0) {
+            ::pthread_mutex_init(&this->mutex, NULL);
+            pthread_condattr_t attr;
+            ::pthread_condattr_init(&attr);
+            ::pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            ::pthread_cond_init(&this->cond, &attr);
+            ::pthread_condattr_destroy(&attr);
+        }
+
+        ~_WaitQueue() {
+            ::pthread_cond_destroy(&this->cond);
+            ::pthread_mutex_destroy(&this->mutex);
+        }
+
+        // waiter side: enter(), re-check the condition, wait(), ..., leave()
+        void enter() {
+            ::pthread_mutex_lock(&this->mutex);
+            this->waiters.fetchAdd(1, turf::Relaxed);
+            turf::threadFenceSeqCst();  // pairs with notify_all()
+        }
+
+        void leave() {
+            this->waiters.fetchSub(1, turf::Relaxed);
+            ::pthread_mutex_unlock(&this->mutex);
+        }
+
+        // deadline is CLOCK_MONOTONIC, NULL for no timeout. returns false on timeout.
+        bool wait(const timespec *deadline) {
+            if (deadline == NULL) {
+                ::pthread_cond_wait(&this->cond, &this->mutex);
+                return true;
+            }
+            return ::pthread_cond_timedwait(&this->cond, &this->mutex, deadline) == 0;
+        }
+
+        // call after making progress. cheap if nobody is waiting.
+        void notify_all() {
+            turf::threadFenceSeqCst();
+            if (this->waiters.load(turf::Relaxed) != 0) {
+                ::pthread_mutex_lock(&this->mutex);
+                ::pthread_cond_broadcast(&this->cond);
+                ::pthread_mutex_unlock(&this->mutex);
+            }
+        }
+
+    private:
+        _WaitQueue(const _WaitQueue &);
+        _WaitQueue &operator=(const _WaitQueue &);
+    };
+
 }}  // ::tz::asynclog
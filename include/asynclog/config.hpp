@@ -21,8 +21,10 @@ namespace tz { namespace asynclog {
         std::string pattern;
         std::string level;
         size_t queue_size;
+        uint64_t byte_budget;   // bytes of queued msgs, 0 for no limit
+        std::string shm_stats;  // name of the shm stats page for asynclog-top
 
-        AsyncLoggerConfig() : queue_size(0) {}
+        AsyncLoggerConfig() : queue_size(0), byte_budget(0) {}
     };
 
     struct _Parser {
@@ -195,6 +197,10 @@ namespace tz { namespace asynclog {
             _expect_string(p, obj.level);
         } else if (key == "queue_size") {
             _expect_uint64(p, obj.queue_size);
+        } else if (key == "byte_budget") {
+            _expect_uint64(p, obj.byte_budget);
+        } else if (key == "shm_stats") {
+            _expect_string(p, obj.shm_stats);
         } else {
             _throw_exc(p, "unexpected key: %s", key.c_str());
         }
@@ -262,6 +268,14 @@ namespace tz { namespace asynclog {
         }
     }
 
+    inline size_t _round_up_pow2(size_t n) {
+        size_t p = 2;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
     inline void config_logger(AsyncLogger &logger, AsyncLoggerConfig &config) {
         FileSink *filesink = new FileSink(config.path);
         ILogSink::Ptr sink(filesink);
@@ -273,7 +287,14 @@ namespace tz { namespace asynclog {
             logger.set_level(_level_from_string(config.level));
         }
         if (config.queue_size != 0) {
-            logger.set_queue_size(config.queue_size);
+            // safe on a running logger, so a reload may change it. an unchanged size is a no-op
+            logger.set_queue_size(_round_up_pow2(config.queue_size));
+        }
+        if (config.byte_budget != 0) {
+            logger.set_byte_budget(config.byte_budget);
+        }
+        if (!config.shm_stats.empty()) {
+            logger.set_shm_stats(config.shm_stats);
         }
     }
 
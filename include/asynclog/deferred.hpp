@@ -0,0 +1,414 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+// deferred formatting: printf args are serialized on the producer and rendered on the consumer.
+// payload layout: [const char *fmt][arg][arg]..., %s args stored as [uint32_t len][bytes].
+
+
+namespace tz { namespace asynclog {
+
+    struct LogSite;
+
+    enum _FmtArgType {
+        _FMT_ARG_NONE = 0,      // %%
+        _FMT_ARG_INT,
+        _FMT_ARG_LONG,
+        _FMT_ARG_LLONG,
+        _FMT_ARG_SIZE,
+        _FMT_ARG_INTMAX,
+        _FMT_ARG_PTRDIFF,
+        _FMT_ARG_DOUBLE,
+        _FMT_ARG_LDOUBLE,
+        _FMT_ARG_PTR,
+        _FMT_ARG_STR,
+        _FMT_ARG_BAD,           // not supported, e.g. %n %m %ls and positional args
+    };
+
+    static const uint32_t _fmt_null_str = 0xffffffffu;
+
+    struct _FmtSpec {
+        const char  *begin;     // points to '%'
+        const char  *end;       // one past the conversion char
+        uint8_t     type;       // _FmtArgType
+        uint8_t     nstar;      // number of '*' width/precision args
+        bool        star_prec;
+        int         prec;       // literal precision, -1 if absent
+    };
+
+    // parse one conversion spec, p points to '%'
+    inline const char *_parse_fmt_spec(const char *p, _FmtSpec &spec) {
+        spec.begin = p++;
+        spec.type = _FMT_ARG_BAD;
+        spec.nstar = 0;
+        spec.star_prec = false;
+        spec.prec = -1;
+
+        // flags
+        while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'') {
+            ++p;
+        }
+        // width
+        if (*p == '*') {
+            ++spec.nstar;
+            ++p;
+        } else {
+            while ('0' <= *p && *p <= '9') {
+                ++p;
+            }
+            if (*p == '$') {
+                spec.end = p + 1;
+                return spec.end;    // positional, bad
+            }
+        }
+        // precision
+        if (*p == '.') {
+            ++p;
+            if (*p == '*') {
+                ++spec.nstar;
+                spec.star_prec = true;
+                ++p;
+            } else {
+                spec.prec = 0;
+                while ('0' <= *p && *p <= '9') {
+                    spec.prec = spec.prec * 10 + (*p - '0');
+                    ++p;
+                }
+            }
+        }
+        // length
+        enum { L_NONE, L_L, L_LL, L_BIGL, L_J, L_Z, L_T } len = L_NONE;
+        switch (*p) {
+        case 'h': ++p; if (*p == 'h') { ++p; } break;
+        case 'l': ++p; len = L_L; if (*p == 'l') { ++p; len = L_LL; } break;
+        case 'q': ++p; len = L_LL; break;
+        case 'L': ++p; len = L_BIGL; break;
+        case 'j': ++p; len = L_J; break;
+        case 'z': case 'Z': ++p; len = L_Z; break;
+        case 't': ++p; len = L_T; break;
+        default: break;
+        }
+        // conversion
+        char conv = *p;
+        if (conv != '\0') {
+            ++p;
+        }
+        spec.end = p;
+
+        switch (conv) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            switch (len) {
+            case L_NONE:    spec.type = _FMT_ARG_INT; break;
+            case L_L:       spec.type = _FMT_ARG_LONG; break;
+            case L_LL:
+            case L_BIGL:    spec.type = _FMT_ARG_LLONG; break;
+            case L_J:       spec.type = _FMT_ARG_INTMAX; break;
+            case L_Z:       spec.type = _FMT_ARG_SIZE; break;
+            case L_T:       spec.type = _FMT_ARG_PTRDIFF; break;
+            }
+            break;
+        case 'c':
+            spec.type = (len == L_NONE) ? _FMT_ARG_INT : _FMT_ARG_BAD;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec.type = (len == L_BIGL) ? _FMT_ARG_LDOUBLE : _FMT_ARG_DOUBLE;
+            break;
+        case 's':
+            spec.type = (len == L_NONE) ? _FMT_ARG_STR : _FMT_ARG_BAD;
+            break;
+        case 'p':
+            spec.type = _FMT_ARG_PTR;
+            break;
+        case '%':
+            spec.type = _FMT_ARG_NONE;
+            break;
+        default:
+            break;  // bad
+        }
+        return p;
+    }
+
+    // parsed fmt, cached per call site so it is parsed once
+    struct _FmtPlan {
+        const char              *fmt;
+        std::vector<_FmtSpec>   specs;
+        bool                    ok;     // false if fmt is not supported
+    };
+
+    inline _FmtPlan *_make_fmt_plan(const char *fmt) {
+        _FmtPlan *plan = new _FmtPlan();
+        plan->fmt = fmt;
+        plan->ok = true;
+        const char *p = fmt;
+        while ((p = ::strchr(p, '%')) != NULL) {
+            _FmtSpec spec;
+            p = _parse_fmt_spec(p, spec);
+            if (spec.type == _FMT_ARG_BAD) {
+                plan->ok = false;
+            }
+            plan->specs.push_back(spec);
+        }
+        return plan;
+    }
+
+    // iterates conversion specs of fmt, from plan if available
+    struct _FmtSpecIter {
+        const char *p;
+        const _FmtPlan *plan;
+        size_t idx;
+
+        _FmtSpecIter(const char *fmt, const _FmtPlan *plan)
+            : p(fmt), plan(plan), idx(0)
+        {}
+
+        bool next(_FmtSpec &spec) {
+            if (this->plan != NULL) {
+                if (this->idx == this->plan->specs.size()) {
+                    return false;
+                }
+                spec = this->plan->specs[this->idx++];
+                return true;
+            }
+            this->p = ::strchr(this->p, '%');
+            if (this->p == NULL) {
+                return false;
+            }
+            this->p = _parse_fmt_spec(this->p, spec);
+            return true;
+        }
+    };
+
+    template <class T>
+    inline void _put_arg(char *dst, size_t &off, T value) {
+        if (dst != NULL) {
+            ::memcpy(dst + off, &value, sizeof(value));
+        }
+        off += sizeof(value);
+    }
+
+    template <class T>
+    inline T _get_arg(const char *&src) {
+        T value;
+        ::memcpy(&value, src, sizeof(value));
+        src += sizeof(value);
+        return value;
+    }
+
+    // %s lengths taken by the measuring pass of _serialize_args(), reused by the writing pass
+    struct _StrLens {
+        enum { k_max = 16 };
+        uint32_t len[k_max];
+        size_t n;
+
+        _StrLens() : n(0) {}
+    };
+
+    // serialize args, or only measure if dst is NULL. returns payload size, 0 if fmt is not supported.
+    // lens, if given, is filled when measuring and used when writing, so strlen() runs once per %s.
+    inline size_t _serialize_args(char *dst, const char *fmt, const _FmtPlan *plan, va_list ap,
+        _StrLens *lens = NULL)
+    {
+        if (plan != NULL && !plan->ok) {
+            return 0;
+        }
+
+        size_t off = 0;
+        size_t nstr = 0;
+        _put_arg(dst, off, fmt);
+
+        _FmtSpecIter it(fmt, plan);
+        _FmtSpec spec;
+        while (it.next(spec)) {
+
+            int star_prec = -1;
+            for (uint8_t i = 0; i < spec.nstar; ++i) {
+                int v = va_arg(ap, int);
+                _put_arg(dst, off, v);
+                if (spec.star_prec && i + 1 == spec.nstar) {
+                    star_prec = v;
+                }
+            }
+
+            switch (spec.type) {
+            case _FMT_ARG_NONE:     break;
+            case _FMT_ARG_INT:      _put_arg(dst, off, va_arg(ap, int)); break;
+            case _FMT_ARG_LONG:     _put_arg(dst, off, va_arg(ap, long)); break;
+            case _FMT_ARG_LLONG:    _put_arg(dst, off, va_arg(ap, long long)); break;
+            case _FMT_ARG_SIZE:     _put_arg(dst, off, va_arg(ap, size_t)); break;
+            case _FMT_ARG_INTMAX:   _put_arg(dst, off, va_arg(ap, intmax_t)); break;
+            case _FMT_ARG_PTRDIFF:  _put_arg(dst, off, va_arg(ap, ptrdiff_t)); break;
+            case _FMT_ARG_DOUBLE:   _put_arg(dst, off, va_arg(ap, double)); break;
+            case _FMT_ARG_LDOUBLE:  _put_arg(dst, off, va_arg(ap, long double)); break;
+            case _FMT_ARG_PTR:      _put_arg(dst, off, va_arg(ap, void *)); break;
+            case _FMT_ARG_STR: {
+                const char *s = va_arg(ap, const char *);
+                int prec = spec.star_prec ? star_prec : spec.prec;
+                if (s == NULL) {
+                    _put_arg(dst, off, _fmt_null_str);
+                    break;
+                }
+                uint32_t len = 0;
+                if (dst != NULL && lens != NULL && nstr < lens->n) {
+                    len = lens->len[nstr];
+                } else {
+                    len = (uint32_t)(prec >= 0 ? ::strnlen(s, (size_t)prec) : ::strlen(s));
+                    if (dst == NULL && lens != NULL && nstr < _StrLens::k_max) {
+                        lens->len[nstr] = len;
+                        lens->n = nstr + 1;
+                    }
+                }
+                ++nstr;
+                _put_arg(dst, off, len);
+                if (dst != NULL) {
+                    ::memcpy(dst + off, s, len);
+                }
+                off += len;
+            } break;
+            default:
+                return 0;
+            }
+        }
+        return off;
+    }
+
+    template <class T>
+    inline void _render_arg(std::string &buf, const char *spec, uint8_t nstar, const int *stars, T value) {
+        char tmp[128];
+        int n = -1;
+        switch (nstar) {
+        case 0: n = TZ_ASYNCLOG_SNPRINTF(tmp, sizeof(tmp), spec, value); break;
+        case 1: n = TZ_ASYNCLOG_SNPRINTF(tmp, sizeof(tmp), spec, stars[0], value); break;
+        default: n = TZ_ASYNCLOG_SNPRINTF(tmp, sizeof(tmp), spec, stars[0], stars[1], value); break;
+        }
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < sizeof(tmp)) {
+            buf.append(tmp, (size_t)n);
+            return;
+        }
+
+        // wide field
+        std::vector<char> big((size_t)n + 1);
+        switch (nstar) {
+        case 0: TZ_ASYNCLOG_SNPRINTF(&big[0], big.size(), spec, value); break;
+        case 1: TZ_ASYNCLOG_SNPRINTF(&big[0], big.size(), spec, stars[0], value); break;
+        default: TZ_ASYNCLOG_SNPRINTF(&big[0], big.size(), spec, stars[0], stars[1], value); break;
+        }
+        buf.append(&big[0], (size_t)n);
+    }
+
+    // render payload made by _serialize_args() as text
+    inline void _render_args(std::string &buf, const char *data, size_t size, const _FmtPlan *plan) {
+        const char *end = data + size;
+        const char *in = data;
+        const char *fmt = _get_arg<const char *>(in);
+        if (plan != NULL && plan->fmt != fmt) {
+            plan = NULL;
+        }
+
+        const char *p = fmt;
+        _FmtSpecIter it(fmt, plan);
+        _FmtSpec spec;
+        while (true) {
+            if (!it.next(spec)) {
+                buf.append(p);
+                return;
+            }
+            buf.append(p, spec.begin - p);
+            p = spec.end;
+
+            if (spec.type == _FMT_ARG_NONE) {
+                buf.push_back('%');
+                continue;
+            }
+
+            char specbuf[32];
+            size_t speclen = spec.end - spec.begin;
+            if (speclen >= sizeof(specbuf) || in > end) {
+                buf.append(spec.begin, speclen);   // unreasonable spec, checked by producer
+                continue;
+            }
+            ::memcpy(specbuf, spec.begin, speclen);
+            specbuf[speclen] = '\0';
+
+            int stars[2] = { 0, 0 };
+            for (uint8_t i = 0; i < spec.nstar; ++i) {
+                stars[i] = _get_arg<int>(in);
+            }
+
+            switch (spec.type) {
+            case _FMT_ARG_INT:      _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<int>(in)); break;
+            case _FMT_ARG_LONG:     _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<long>(in)); break;
+            case _FMT_ARG_LLONG:    _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<long long>(in)); break;
+            case _FMT_ARG_SIZE:     _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<size_t>(in)); break;
+            case _FMT_ARG_INTMAX:   _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<intmax_t>(in)); break;
+            case _FMT_ARG_PTRDIFF:  _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<ptrdiff_t>(in)); break;
+            case _FMT_ARG_DOUBLE:   _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<double>(in)); break;
+            case _FMT_ARG_LDOUBLE:  _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<long double>(in)); break;
+            case _FMT_ARG_PTR:      _render_arg(buf, specbuf, spec.nstar, stars, _get_arg<void *>(in)); break;
+            case _FMT_ARG_STR: {
+                uint32_t len = _get_arg<uint32_t>(in);
+                if (len == _fmt_null_str) {
+                    _render_arg(buf, specbuf, spec.nstar, stars, (const char *)NULL);
+                } else if (speclen == 2) {
+                    buf.append(in, len);    // plain %s
+                    in += len;
+                } else {
+                    std::string s(in, len);
+                    in += len;
+                    _render_arg(buf, specbuf, spec.nstar, stars, s.c_str());
+                }
+            } break;
+            default:
+                buf.append(spec.begin, speclen);   // not reached, producer falls back to eager formatting
+                break;
+            }
+        }
+    }
+
+    // payload writer for AsyncLogger, see _BinArgs
+    struct _DeferredArgs {
+        const LogSite *site;
+        const char *fmt;
+        const _FmtPlan *plan;
+        va_list ap;
+        size_t size;    // 0 if fmt is not supported
+        uint8_t flags;
+        _StrLens lens;
+
+        _DeferredArgs(const LogSite *site, const char *fmt, const _FmtPlan *plan, va_list ap, uint8_t flags)
+            : site(site), fmt(fmt), plan(plan), size(0), flags(flags)
+        {
+            va_copy(this->ap, ap);
+            va_list tmp;
+            va_copy(tmp, this->ap);
+            this->size = _serialize_args(NULL, fmt, plan, tmp, &this->lens);
+            va_end(tmp);
+        }
+
+        ~_DeferredArgs() {
+            va_end(this->ap);
+        }
+
+        bool write(char *dst) {
+            va_list tmp;
+            va_copy(tmp, this->ap);
+            _serialize_args(dst, this->fmt, this->plan, tmp, &this->lens);
+            va_end(tmp);
+            return true;
+        }
+
+    private:
+        _DeferredArgs(const _DeferredArgs &);
+        _DeferredArgs &operator=(const _DeferredArgs &);
+    };
+
+}}  // ::tz::asynclog
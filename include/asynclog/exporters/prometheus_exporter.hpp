@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+
+#include "../asynclog.hpp"
+
+
+namespace tz { namespace asynclog {
+
+    // rewrites a file in prometheus text format for node_exporter's textfile collector.
+    // written to path.tmp then renamed, scrapers never see a partial file.
+    struct PrometheusFileExporter : IMetricsExporter {
+        // name is the value of the logger label
+        PrometheusFileExporter(const std::string &path, const std::string &name)
+            : path(path), tmp_path(path + ".tmp"), name(name)
+        {}
+
+        virtual void export_metrics(AsyncLogger &logger) {
+            MetricsSnapshot snap;
+            logger.get_metrics(snap);
+            AsyncLogger::Stats &stats = logger.stats;
+
+            std::string &buf = this->buf;
+            buf.clear();
+
+            this->_counter("asynclog_messages_total", "msgs logged", stats.total.load(turf::Relaxed));
+            this->_counter("asynclog_dropped_total", "msgs dropped", stats.drop.load(turf::Relaxed));
+            this->_help("asynclog_dropped_by_level_total", "counter", "msgs dropped by level");
+            for (size_t i = ALOG_LVL_DEBUG; i < ALOG_LVL_MAX; ++i) {
+                this->_sample("asynclog_dropped_by_level_total", "level", _prom_level_name(i),
+                    stats.drop_level[i].load(turf::Relaxed));
+            }
+            this->_help("asynclog_written_total", "counter", "msgs given to sink by level");
+            for (size_t i = ALOG_LVL_DEBUG; i < ALOG_LVL_MAX; ++i) {
+                this->_sample("asynclog_written_total", "level", _prom_level_name(i), snap.written[i]);
+            }
+            this->_counter("asynclog_written_bytes_total", "bytes written by sink", snap.write_bytes);
+            this->_counter("asynclog_format_errors_total", "bad vsnprintf calls", stats.err.load(turf::Relaxed));
+            this->_counter("asynclog_truncated_total", "msgs truncated", stats.trunc.load(turf::Relaxed));
+            this->_counter("asynclog_chunked_total", "msgs split into chunks", stats.chunked.load(turf::Relaxed));
+            this->_counter("asynclog_shed_total", "msgs shed under load", stats.shed.load(turf::Relaxed));
+            this->_counter("asynclog_coalesced_total", "repeated msgs not written", stats.coalesced.load(turf::Relaxed));
+            this->_counter("asynclog_blocked_total", "producers blocked on full queue", stats.blocked.load(turf::Relaxed));
+            this->_counter("asynclog_blocked_seconds_total", "time producers were blocked",
+                stats.blocked_us.load(turf::Relaxed) / 1e6);
+            this->_counter("asynclog_block_timeouts_total", "blocked producers that gave up",
+                stats.block_timeout.load(turf::Relaxed));
+            this->_counter("asynclog_queue_resizes_total", "queue resizes", stats.resize.load(turf::Relaxed));
+            this->_counter("asynclog_budget_full_total", "creates refused by the byte budget",
+                stats.budget_full.load(turf::Relaxed));
+
+            this->_gauge("asynclog_queue_depth", "queued msgs at the last pop, bytes with the ring queue", snap.depth);
+            this->_gauge("asynclog_queue_depth_hwm", "max queue depth in the last interval", snap.depth_hwm_last);
+            this->_gauge("asynclog_inflight_bytes", "bytes of queued msgs", stats.inflight_bytes.load(turf::Relaxed));
+            this->_gauge("asynclog_inflight_peak_bytes", "max bytes of queued msgs",
+                stats.inflight_peak.load(turf::Relaxed));
+            this->_gauge("asynclog_pool_bytes", "bytes held by the msg pool", stats.pool_bytes.load(turf::Relaxed));
+
+            this->_counter("asynclog_sink_seconds_total", "time in sink", snap.sink_ns / 1e9);
+            this->_counter("asynclog_format_seconds_total", "time formatting in sink", snap.format_ns / 1e9);
+            this->_counter("asynclog_write_seconds_total", "time writing in sink", snap.write_ns / 1e9);
+            this->_counter("asynclog_flush_seconds_total", "time flushing sink", snap.flush_ns / 1e9);
+
+            // one bucket per power of 2 from 1us, finer buckets are summed up
+            const char *hist = "asynclog_latency_seconds";
+            this->_help(hist, "histogram", "time from log call to sink");
+            uint64_t count = 0;
+            for (size_t i = 0; i < TZ_ASYNCLOG_LATENCY_BUCKETS; ++i) {
+                count += snap.latency[i];
+                uint64_t upper = latency_bucket_upper(i);
+                if ((i & 3) == 3 && upper >= 1024 && upper <= (1ull << 36)) {
+                    char le[32];
+                    snprintf(le, sizeof(le), "%.9g", upper / 1e9);
+                    this->_sample("asynclog_latency_seconds_bucket", "le", le, count);
+                }
+            }
+            this->_sample("asynclog_latency_seconds_bucket", "le", "+Inf", snap.latency_count);
+            this->_sample("asynclog_latency_seconds_sum", NULL, NULL, snap.latency_sum_ns / 1e9);
+            this->_sample("asynclog_latency_seconds_count", NULL, NULL, snap.latency_count);
+
+            if (!this->_write_file(logger)) {
+                logger._internal_log(ALOG_LVL_ERROR, "can not write metrics file. [errno:%d][path:%s]",
+                    errno, this->path.c_str());
+            }
+        }
+
+        // private
+        bool _write_file(AsyncLogger &logger) {
+            int fd = ::open(this->tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            const char *data = this->buf.data();
+            size_t size = this->buf.size();
+            while (size > 0) {
+                ssize_t rv = ::write(fd, data, size);
+                if (rv < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (rv <= 0) {
+                    ::close(fd);
+                    return false;
+                }
+                data += rv;
+                size -= (size_t)rv;
+            }
+            if (::close(fd) != 0) {
+                logger._internal_log(ALOG_LVL_ERROR, "close() failed. [errno:%d][path:%s]",
+                    errno, this->tmp_path.c_str());
+            }
+            return ::rename(this->tmp_path.c_str(), this->path.c_str()) == 0;
+        }
+
+        void _help(const char *metric, const char *type, const char *help) {
+            char line[256];
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+            this->buf += line;
+        }
+
+        // label may be NULL
+        void _sample(const char *metric, const char *label, const char *value, double sample) {
+            char line[256];
+            if (label != NULL) {
+                snprintf(line, sizeof(line), "%s{logger=\"%s\",%s=\"%s\"} %.15g\n",
+                    metric, this->name.c_str(), label, value, sample);
+            } else {
+                snprintf(line, sizeof(line), "%s{logger=\"%s\"} %.15g\n", metric, this->name.c_str(), sample);
+            }
+            this->buf += line;
+        }
+
+        void _counter(const char *metric, const char *help, double value) {
+            this->_help(metric, "counter", help);
+            this->_sample(metric, NULL, NULL, value);
+        }
+
+        void _gauge(const char *metric, const char *help, double value) {
+            this->_help(metric, "gauge", help);
+            this->_sample(metric, NULL, NULL, value);
+        }
+
+        static const char *_prom_level_name(size_t level) {
+            switch (level) {
+            case ALOG_LVL_DEBUG:    return "debug";
+            case ALOG_LVL_INFO:     return "info";
+            case ALOG_LVL_NOTICE:   return "notice";
+            case ALOG_LVL_WARN:     return "warn";
+            case ALOG_LVL_ERROR:    return "error";
+            case ALOG_LVL_FATAL:    return "fatal";
+            default:                return "unknown";
+            }
+        }
+
+        std::string path;
+        std::string tmp_path;
+        std::string name;
+        std::string buf;
+    };
+
+}}  // ::tz::asynclog
@@ -6,6 +6,7 @@
 #include <libgen.h>     // for basename
 #include <vector>
 #include <map>
+#include <algorithm>    // for std::max
 
 #include "asynclog.hpp"
 #include "helper.hpp"
@@ -104,7 +105,8 @@ namespace tz { namespace asynclog {
     }
 
     struct _TimeCache {
-        struct timeval  timeval;
+        time_t          sec;
+        uint32_t        msec_num;
         std::string     year;
         std::string     month;
         std::string     day;
@@ -115,14 +117,13 @@ namespace tz { namespace asynclog {
         std::string     yyyy_mm_dd;
         std::string     hh_mm_ss;
 
-        _TimeCache() {
-            this->timeval.tv_sec = this->timeval.tv_usec = 0;
-        }
+        _TimeCache() : sec(0), msec_num(0) {}
 
-        void update(const struct timeval &tv) {
-            this->timeval = tv;
+        void update(uint64_t ns) {
+            this->sec = (time_t)(ns / 1000000000);
+            this->msec_num = (uint32_t)(ns % 1000000000 / 1000000);
 
-            time_t ts = tv.tv_sec;
+            time_t ts = this->sec;
             struct tm stm;
             localtime_r(&ts, &stm);
 
@@ -149,14 +150,14 @@ namespace tz { namespace asynclog {
 
             this->hh_mm_ss = this->hour + ":" + this->minute + ":" + this->second;
 
-            snprintf(buf, sizeof(buf), "%03ld", tv.tv_usec / 1000);
+            snprintf(buf, sizeof(buf), "%03u", this->msec_num);
             this->msec = buf;
         }
 
 #define _TIMECACHE_GETTER(name) \
-        const std::string &get_ ## name(const struct timeval &tv) { \
-            if (this->timeval.tv_sec != tv.tv_sec) { \
-                this->update(tv); \
+        const std::string &get_ ## name(uint64_t ns) { \
+            if (this->sec != (time_t)(ns / 1000000000)) { \
+                this->update(ns); \
             } \
             return this->name; \
         }
@@ -172,13 +173,14 @@ namespace tz { namespace asynclog {
 
 #undef _TIMECACHE_GETTER
 
-        const std::string &get_msec(const struct timeval &tv) {
-            if (this->timeval.tv_sec != tv.tv_sec) {
-                this->update(tv);
-            } else if (this->timeval.tv_usec / 1000 != tv.tv_usec / 1000) {
-                this->timeval.tv_usec = tv.tv_usec;
+        const std::string &get_msec(uint64_t ns) {
+            uint32_t msec_num = (uint32_t)(ns % 1000000000 / 1000000);
+            if (this->sec != (time_t)(ns / 1000000000)) {
+                this->update(ns);
+            } else if (this->msec_num != msec_num) {
+                this->msec_num = msec_num;
                 char buf[32];
-                snprintf(buf, sizeof(buf), "%03ld", tv.tv_usec / 1000);
+                snprintf(buf, sizeof(buf), "%03u", msec_num);
                 this->msec = buf;
             }
             return this->msec;
@@ -215,7 +217,7 @@ namespace tz { namespace asynclog {
                     if (e[0].tid == (uint32_t)msg->tid) {
                         return e[0].digits;
                     }
-                    if (_hash(msg->time.tv_usec) % 2) {
+                    if (_hash((pid_t)(msg->time_ns / 1000)) % 2) {
                         --e;
                     }
                 }
@@ -257,8 +259,11 @@ namespace tz { namespace asynclog {
         }
 
         virtual void format(std::string &buf, LogMsg *msg) {
-            // estimate buffer size
-            buf.reserve(this->specs_size + msg->msg_size + 1);
+            // estimate buffer size, buf may already hold other msgs of a batch
+            size_t need = buf.size() + this->specs_size + msg->msg_size + 1;
+            if (buf.capacity() < need) {
+                buf.reserve(std::max(need, buf.capacity() * 2));
+            }
             for (size_t i = 0; i < this->specs.size(); ++i) {
                 if (this->specs[i].func == NULL) {
                     buf.append(this->specs[i].data);
@@ -298,13 +303,16 @@ namespace tz { namespace asynclog {
 
     // patterns
     // %%
-    // %(year) %(month) %(day) %(hour) %(minute) %(second) %(msec) $(usec)
+    // %(year) %(month) %(day) %(hour) %(minute) %(second) %(msec) %(usec) %(nsec)
+    // %(mono), monotonic seconds with 9 decimals, see AsyncLogger::set_monotonic_stamp()
     // %(YYYY-MM-DD) %(HH:MM:SS)
     // %(level) %(msg) %(process) %(tid)
+    // %(file) %(line) %(func), '?' if not logged by TZ_ASYNC_LOG
+    // %(seq)
 
 #define _SPEC_TIME(name) \
     inline void _spec_ ## name(DefaultFormtter &fmt, std::string &buf, LogMsg *msg) { \
-        buf.append(fmt._timecache.get_ ## name(msg->time)); \
+        buf.append(fmt._timecache.get_ ## name(msg->time_ns)); \
     }
 
     _SPEC_TIME(year)
@@ -318,10 +326,16 @@ namespace tz { namespace asynclog {
     _SPEC_TIME(hh_mm_ss)
 
     inline void _spec_usec(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_nsec(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_mono(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
     inline void _spec_level(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
     inline void _spec_msg(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
     inline void _spec_process(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
     inline void _spec_tid(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_file(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_line(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_func(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
+    inline void _spec_seq(DefaultFormtter &fmt, std::string &buf, LogMsg *msg);
 
     inline _SpecFunc _name_to_func(const std::string &name) {
 #define _N2F_BRANCH(val) else if (name == #val) { return _spec_ ## val; }
@@ -334,10 +348,16 @@ namespace tz { namespace asynclog {
         _N2F_BRANCH(second)
         _N2F_BRANCH(msec)
         _N2F_BRANCH(usec)
+        _N2F_BRANCH(nsec)
+        _N2F_BRANCH(mono)
         _N2F_BRANCH(level)
         _N2F_BRANCH(msg)
         _N2F_BRANCH(process)
         _N2F_BRANCH(tid)
+        _N2F_BRANCH(file)
+        _N2F_BRANCH(line)
+        _N2F_BRANCH(func)
+        _N2F_BRANCH(seq)
         else if (::strcasecmp(name.c_str(), "yyyy-mm-dd") == 0) {
             return _spec_yyyy_mm_dd;
         }
@@ -364,9 +384,15 @@ namespace tz { namespace asynclog {
             _SSS_BRANCH(second, 2)
             _SSS_BRANCH(msec, 3)
             _SSS_BRANCH(usec, 6)
+            _SSS_BRANCH(nsec, 9)
+            _SSS_BRANCH(mono, 16)
             _SSS_BRANCH(level, 6)
             _SSS_BRANCH(process, _get_process_name().size())
             _SSS_BRANCH(tid, 10)
+            _SSS_BRANCH(file, 16)
+            _SSS_BRANCH(line, 4)
+            _SSS_BRANCH(func, 16)
+            _SSS_BRANCH(seq, 8)
             _SSS_BRANCH(yyyy_mm_dd, 10)
             _SSS_BRANCH(hh_mm_ss, 8)
             // else dont care
@@ -398,8 +424,7 @@ namespace tz { namespace asynclog {
     static const _Digit100 _digit100;
 
     inline void _spec_usec(DefaultFormtter &, std::string &buf, LogMsg *msg) {
-        uint32_t num = (uint32_t)msg->time.tv_usec;
-        num %= 1000000;     // impossible
+        uint32_t num = (uint32_t)(msg->time_ns / 1000 % 1000000);
 
         union {
             char buf[6];
@@ -415,12 +440,60 @@ namespace tz { namespace asynclog {
         buf.append(fmtbuf.buf, 6);
     }
 
+    // 9 digits, num < 1000000000
+    inline void _append_nsec_digits(std::string &buf, uint32_t num) {
+        union {
+            char buf[10];
+            uint16_t words[5];
+        } fmtbuf;
+
+        fmtbuf.words[4] = _digit100.words[num % 100];
+        num /= 100;
+        fmtbuf.words[3] = _digit100.words[num % 100];
+        num /= 100;
+        fmtbuf.words[2] = _digit100.words[num % 100];
+        num /= 100;
+        fmtbuf.words[1] = _digit100.words[num % 100];
+        num /= 100;
+        fmtbuf.words[0] = _digit100.words[num];
+
+        buf.append(fmtbuf.buf + 1, 9);
+    }
+
+    inline void _spec_nsec(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        _append_nsec_digits(buf, (uint32_t)(msg->time_ns % 1000000000));
+    }
+
+    inline void _spec_mono(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        uint64_t sec = msg->mono_ns / 1000000000;
+        char fmtbuf[24];
+        char *p = fmtbuf + sizeof(fmtbuf);
+        do {
+            p -= 2;
+            ::memcpy(p, &_digit100.words[sec % 100], 2);
+            sec /= 100;
+        } while (sec != 0);
+        if (*p == '0' && p + 1 < fmtbuf + sizeof(fmtbuf)) {
+            ++p;    // odd number of digits
+        }
+        buf.append(p, fmtbuf + sizeof(fmtbuf) - p);
+        buf.push_back('.');
+        _append_nsec_digits(buf, (uint32_t)(msg->mono_ns % 1000000000));
+    }
+
     inline void _spec_level(DefaultFormtter &fmt, std::string &buf, LogMsg *msg) {
         buf.append(fmt._get_level(msg->level));
     }
 
     inline void _spec_msg(DefaultFormtter &, std::string &buf, LogMsg *msg) {
-        buf.append(msg->msg_data, msg->msg_size);
+        if (msg->flags & MSGFLAG_LITERAL) {
+            buf.append(msg->site->fmt);
+        } else if (msg->flags & MSGFLAG_DEFERRED) {
+            const _FmtPlan *plan = msg->site ? msg->site->state->plan.load(turf::Acquire) : NULL;
+            _render_args(buf, msg->msg_data, msg->msg_size, plan);
+        } else {
+            buf.append(msg->msg_data, msg->msg_size);
+        }
     }
 
     inline void _spec_process(DefaultFormtter &, std::string &buf, LogMsg *) {
@@ -434,4 +507,34 @@ namespace tz { namespace asynclog {
         // buf.append(fmtbuf);
     }
 
+    inline void _spec_file(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        buf.append(msg->site ? msg->site->file : "?");
+    }
+
+    inline void _append_uint(std::string &buf, uint64_t num) {
+        char fmtbuf[24];
+        char *p = fmtbuf + sizeof(fmtbuf);
+        do {
+            *--p = (char)('0' + num % 10);
+            num /= 10;
+        } while (num != 0);
+        buf.append(p, fmtbuf + sizeof(fmtbuf) - p);
+    }
+
+    inline void _spec_line(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        if (msg->site == NULL) {
+            buf.push_back('?');
+            return;
+        }
+        _append_uint(buf, (uint32_t)msg->site->line);
+    }
+
+    inline void _spec_func(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        buf.append(msg->site ? msg->site->func : "?");
+    }
+
+    inline void _spec_seq(DefaultFormtter &, std::string &buf, LogMsg *msg) {
+        _append_uint(buf, msg->seq);
+    }
+
 }}  // ::tz::asynclog
@@ -2,6 +2,8 @@
 
 #include <unistd.h>
 #include <libgen.h>
+#include <stdlib.h>     // for posix_memalign
+#include <new>
 
 #if __cplusplus < 201103L
 #   include <tr1/memory>
@@ -28,6 +30,31 @@ namespace tz { namespace asynclog {
     template <class T>
     T _StaticSingleton<T>::instance;
 
+    // n T starting on a cache line, free with _delete_aligned()
+    template <class T>
+    inline T *_new_aligned(size_t n) {
+        void *p = NULL;
+        if (::posix_memalign(&p, 64, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        T *arr = (T *)p;
+        for (size_t i = 0; i < n; ++i) {
+            new (arr + i) T();
+        }
+        return arr;
+    }
+
+    template <class T>
+    inline void _delete_aligned(T *arr, size_t n) {
+        if (arr == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            arr[i].~T();
+        }
+        ::free(arr);
+    }
+
     // linux only
     inline std::string _get_process_name_impl() {
         const size_t bufsize = 1024 * 4;
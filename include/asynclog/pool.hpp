@@ -0,0 +1,278 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cassert>
+#include <vector>
+
+#include <turf/Atomic.h>
+
+#include "concurrency.hpp"
+
+
+namespace tz { namespace asynclog {
+
+    // block sizes including _PoolBlock header, larger blocks go to malloc()
+    static const size_t _pool_class_sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+    static const size_t _pool_class_count = sizeof(_pool_class_sizes) / sizeof(_pool_class_sizes[0]);
+    static const size_t _pool_slab_size = 16 * 1024;
+    static const size_t _pool_return_batch = 32;
+
+    struct _PoolCache;
+
+    struct _PoolBlock {
+        _PoolCache  *owner;     // NULL for large blocks
+        _PoolBlock  *next;      // free list link
+        size_t      cls;
+    };
+
+    // per producer thread. blocks freed by the consumer are returned to the owner in batches.
+    struct _PoolCache {
+        // owner only
+        _PoolBlock *free_list[_pool_class_count];
+        std::vector<void *> slabs;
+        turf::Atomic<uint64_t> taken;   // written by owner, read by consumer
+        char _pad0[64];
+
+        // consumer only
+        _PoolBlock *pending_head;
+        _PoolBlock *pending_tail;
+        size_t pending_count;
+        uint64_t returned;
+        char _pad1[64];
+
+        // shared
+        turf::Atomic<_PoolBlock *> returns;     // pushed by consumer, taken all at once by owner
+        turf::Atomic<uint8_t> orphaned;         // owner thread exited, may be adopted
+        _PoolCache *next;                       // registry link, immutable after publish
+
+        _PoolCache()
+            : taken(0)
+            , pending_head(NULL), pending_tail(NULL), pending_count(0), returned(0)
+            , returns(NULL), orphaned(0), next(NULL)
+        {
+            for (size_t i = 0; i < _pool_class_count; ++i) {
+                this->free_list[i] = NULL;
+            }
+        }
+
+        ~_PoolCache() {
+            for (size_t i = 0; i < this->slabs.size(); ++i) {
+                ::free(this->slabs[i]);
+            }
+        }
+
+        void _collect() {
+            _PoolBlock *blk = this->returns.exchange(NULL, turf::Acquire);
+            while (blk != NULL) {
+                _PoolBlock *next = blk->next;
+                blk->next = this->free_list[blk->cls];
+                this->free_list[blk->cls] = blk;
+                blk = next;
+            }
+        }
+
+        size_t _grow(size_t cls) {
+            char *slab = (char *)::malloc(_pool_slab_size);
+            if (slab == NULL) {
+                return 0;
+            }
+            this->slabs.push_back(slab);
+
+            size_t bsize = _pool_class_sizes[cls];
+            for (size_t off = 0; off + bsize <= _pool_slab_size; off += bsize) {
+                _PoolBlock *blk = (_PoolBlock *)(slab + off);
+                blk->owner = this;
+                blk->cls = cls;
+                blk->next = this->free_list[cls];
+                this->free_list[cls] = blk;
+            }
+            return _pool_slab_size;
+        }
+
+        void _flush_pending() {
+            if (this->pending_head == NULL) {
+                return;
+            }
+            _PoolBlock *head = this->returns.load(turf::Relaxed);
+            do {
+                this->pending_tail->next = head;
+            } while (!this->returns.compareExchangeWeak(head, this->pending_head, turf::Release, turf::Relaxed));
+
+            this->returned += this->pending_count;
+            this->pending_head = this->pending_tail = NULL;
+            this->pending_count = 0;
+        }
+
+    private:
+        _PoolCache(const _PoolCache &);
+        _PoolCache &operator=(const _PoolCache &);
+    };
+
+    // size-classed slab pool for LogMsg. alloc() from producers, free() from the consumer,
+    // or from the owner thread itself.
+    struct _Pool {
+        _Pool() : key_state(KEY_NONE), caches(NULL), slab_bytes(0), large(0) {}
+
+        ~_Pool() {
+            if (this->key_state.load(turf::Acquire) == KEY_READY) {
+                ::pthread_key_delete(this->key);
+            }
+            _PoolCache *cache = this->caches.load(turf::Acquire);
+            while (cache != NULL) {
+                _PoolCache *next = cache->next;
+                delete cache;
+                cache = next;
+            }
+        }
+
+        static size_t _class_of(size_t size) {
+            size_t cls = 0;
+            while (cls < _pool_class_count && _pool_class_sizes[cls] < size) {
+                ++cls;
+            }
+            return cls;
+        }
+
+        static void _orphan(void *arg) {
+            _PoolCache *cache = (_PoolCache *)arg;
+            cache->orphaned.store(1, turf::Release);
+        }
+
+        // keys are limited, made on first alloc() so loggers not using the pool take none
+        void _create_key() {
+            uint8_t state = this->key_state.compareExchange(KEY_NONE, KEY_CREATING, turf::Acquire);
+            if (state == KEY_NONE) {
+                int rc = ::pthread_key_create(&this->key, &_Pool::_orphan);
+                if (rc != 0) {
+                    this->key_state.store(KEY_NONE, turf::Release);
+                    throw _ThreadException("pthread_key_create() failed", rc);
+                }
+                this->key_state.store(KEY_READY, turf::Release);
+                return;
+            }
+            while (this->key_state.load(turf::Acquire) == KEY_CREATING) {
+                ::sched_yield();
+            }
+        }
+
+        _PoolCache *_get_cache() {
+            if (this->key_state.load(turf::Acquire) != KEY_READY) {
+                this->_create_key();
+            }
+            _PoolCache *cache = (_PoolCache *)::pthread_getspecific(this->key);
+            if (cache != NULL) {
+                return cache;
+            }
+
+            // adopt a cache left by an exited thread
+            _PoolCache *head = this->caches.load(turf::Acquire);
+            for (cache = head; cache != NULL; cache = cache->next) {
+                if (cache->orphaned.load(turf::Relaxed) == 1
+                    && cache->orphaned.compareExchange(1, 0, turf::Acquire) == 1)
+                {
+                    break;
+                }
+            }
+
+            if (cache == NULL) {
+                cache = new _PoolCache();
+                do {
+                    cache->next = head;
+                } while (!this->caches.compareExchangeWeak(head, cache, turf::Release, turf::Relaxed));
+            }
+
+            ::pthread_setspecific(this->key, cache);
+            return cache;
+        }
+
+        void *alloc(size_t size) {
+            size_t need = sizeof(_PoolBlock) + size;
+            size_t cls = _class_of(need);
+            _PoolBlock *blk = NULL;
+            if (cls == _pool_class_count) {
+                blk = (_PoolBlock *)::malloc(need);
+                if (blk == NULL) {
+                    return NULL;
+                }
+                blk->owner = NULL;
+                blk->cls = cls;
+                this->large.fetchAdd(1, turf::Relaxed);
+                return blk + 1;
+            }
+
+            _PoolCache *cache = this->_get_cache();
+            if (cache->free_list[cls] == NULL) {
+                cache->_collect();
+            }
+            if (cache->free_list[cls] == NULL) {
+                size_t grown = cache->_grow(cls);
+                if (grown == 0) {
+                    return NULL;
+                }
+                this->slab_bytes.fetchAdd(grown, turf::Relaxed);
+            }
+
+            blk = cache->free_list[cls];
+            cache->free_list[cls] = blk->next;
+            cache->taken.store(cache->taken.load(turf::Relaxed) + 1, turf::Relaxed);
+            return blk + 1;
+        }
+
+        void free(void *ptr) {
+            _PoolBlock *blk = (_PoolBlock *)ptr - 1;
+            _PoolCache *owner = blk->owner;
+            if (owner == NULL) {
+                this->large.fetchSub(1, turf::Relaxed);
+                ::free(blk);
+                return;
+            }
+
+            if (owner == ::pthread_getspecific(this->key)) {
+                // freed by owner, e.g. enqueue failed
+                blk->next = owner->free_list[blk->cls];
+                owner->free_list[blk->cls] = blk;
+                owner->taken.store(owner->taken.load(turf::Relaxed) - 1, turf::Relaxed);
+                return;
+            }
+
+            // consumer
+            blk->next = NULL;
+            if (owner->pending_tail == NULL) {
+                owner->pending_head = blk;
+            } else {
+                owner->pending_tail->next = blk;
+            }
+            owner->pending_tail = blk;
+            if (++owner->pending_count >= _pool_return_batch) {
+                owner->_flush_pending();
+            }
+        }
+
+        // consumer only. returns blocks held in pending batches, counts blocks in use.
+        uint64_t flush_pending() {
+            uint64_t inuse = 0;
+            _PoolCache *cache = this->caches.load(turf::Acquire);
+            for (; cache != NULL; cache = cache->next) {
+                cache->_flush_pending();
+                inuse += cache->taken.load(turf::Relaxed) - cache->returned;
+            }
+            return inuse;
+        }
+
+        enum { KEY_NONE = 0, KEY_CREATING, KEY_READY };
+
+        pthread_key_t key;
+        turf::Atomic<uint8_t> key_state;       // KEY_*, key is valid once KEY_READY
+        turf::Atomic<_PoolCache *> caches;     // newest first, never shrinks
+        turf::Atomic<uint64_t> slab_bytes;
+        turf::Atomic<uint64_t> large;          // large blocks in use
+
+    private:
+        _Pool(const _Pool &);
+        _Pool &operator=(const _Pool &);
+    };
+
+}}  // ::tz::asynclog
@@ -1,3 +1,4 @@
+#include <string.h>     // for memset
 #include <cassert>
 
 // TODO: remove dependency
@@ -93,6 +94,69 @@ namespace tz { namespace asynclog {
             return true;
         }
 
+        // claim up to max ready cells with one CAS
+        size_t dequeue_bulk(T* out, size_t max)
+        {
+            if (max == 0)
+                return 0;   // ready_count() would be 0 with the head cell ready, spinning forever
+
+            size_t pos = dequeue_pos_.load(turf::Relaxed);
+            size_t n;
+            for (;;)
+            {
+                n = ready_count(pos, max);
+                if (n == 0)
+                {
+                    cell_t* cell = &buffer_[pos & buffer_mask_];
+                    size_t seq = cell->sequence_.load(turf::Acquire);
+                    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+                        return 0;
+                    pos = dequeue_pos_.load(turf::Relaxed);
+                }
+                else if (dequeue_pos_.compareExchangeWeak(pos, pos + n, turf::Relaxed, turf::Relaxed))
+                    break;
+            }
+
+            take(pos, out, n);
+            return n;
+        }
+
+        size_t capacity() const
+        {
+            return buffer_mask_ + 1;
+        }
+
+        // racy, for monitoring only
+        size_t size_approx()
+        {
+            size_t tail = dequeue_pos_.load(turf::Relaxed);
+            size_t head = enqueue_pos_.load(turf::Relaxed);
+            return head > tail ? head - tail : 0;
+        }
+
+        size_t write_pos()
+        {
+            return enqueue_pos_.load(turf::Relaxed);
+        }
+
+        size_t read_pos()
+        {
+            return dequeue_pos_.load(turf::Relaxed);
+        }
+
+        // only valid if there is exactly one consumer, no CAS needed
+        size_t dequeue_bulk_single_consumer(T* out, size_t max)
+        {
+            size_t pos = dequeue_pos_.load(turf::Relaxed);
+            size_t n = ready_count(pos, max);
+            if (n == 0)
+                return 0;
+
+            dequeue_pos_.store(pos + n, turf::Relaxed);
+            take(pos, out, n);
+            return n;
+        }
+
     private:
         struct cell_t
         {
@@ -100,6 +164,30 @@ namespace tz { namespace asynclog {
             T                       data_;
         };
 
+        size_t ready_count(size_t pos, size_t max)
+        {
+            size_t n = 0;
+            while (n < max)
+            {
+                cell_t* cell = &buffer_[(pos + n) & buffer_mask_];
+                size_t seq = cell->sequence_.load(turf::Acquire);
+                if (seq != pos + n + 1)
+                    break;
+                ++n;
+            }
+            return n;
+        }
+
+        void take(size_t pos, T* out, size_t n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                cell_t* cell = &buffer_[(pos + i) & buffer_mask_];
+                out[i] = cell->data_;
+                cell->sequence_.store(pos + i + buffer_mask_ + 1, turf::Release);
+            }
+        }
+
         typedef char                cacheline_pad_t[64];
 
         cacheline_pad_t             pad0_;
@@ -115,6 +203,318 @@ namespace tz { namespace asynclog {
         void operator = (mpmc_bounded_queue const&);
     };
 
+    // single producer, single consumer. wait-free on both sides.
+    template <typename T>
+    class spsc_bounded_queue
+    {
+    public:
+        explicit spsc_bounded_queue(size_t buffer_size)
+            : buffer_(NULL)
+            , buffer_mask_(0)
+            , cached_tail_(0)
+            , cached_head_(0)
+        {
+            assert((buffer_size >= 2) && ((buffer_size & (buffer_size - 1)) == 0));
+
+            buffer_ = new T[buffer_size];
+            buffer_mask_ = buffer_size - 1;
+            head_.store(0, turf::Relaxed);
+            tail_.store(0, turf::Relaxed);
+        }
+
+        ~spsc_bounded_queue()
+        {
+            delete []buffer_;
+        }
+
+        bool enqueue(T const& data)
+        {
+            size_t pos = tail_.load(turf::Relaxed);
+            if (pos - cached_head_ > buffer_mask_)
+            {
+                cached_head_ = head_.load(turf::Acquire);
+                if (pos - cached_head_ > buffer_mask_)
+                    return false;
+            }
+
+            buffer_[pos & buffer_mask_] = data;
+            tail_.store(pos + 1, turf::Release);
+
+            return true;
+        }
+
+        bool dequeue(T& data)
+        {
+            size_t pos = head_.load(turf::Relaxed);
+            if (pos == cached_tail_)
+            {
+                cached_tail_ = tail_.load(turf::Acquire);
+                if (pos == cached_tail_)
+                    return false;
+            }
+
+            data = buffer_[pos & buffer_mask_];
+            head_.store(pos + 1, turf::Release);
+
+            return true;
+        }
+
+        size_t dequeue_bulk(T* out, size_t max)
+        {
+            size_t pos = head_.load(turf::Relaxed);
+            size_t avail = cached_tail_ - pos;
+            if (avail < max)
+            {
+                cached_tail_ = tail_.load(turf::Acquire);
+                avail = cached_tail_ - pos;
+            }
+
+            size_t n = (avail < max) ? avail : max;
+            for (size_t i = 0; i < n; ++i)
+                out[i] = buffer_[(pos + i) & buffer_mask_];
+            if (n != 0)
+                head_.store(pos + n, turf::Release);
+
+            return n;
+        }
+
+        size_t capacity() const
+        {
+            return buffer_mask_ + 1;
+        }
+
+        // racy, for monitoring only
+        size_t size_approx()
+        {
+            size_t head = head_.load(turf::Relaxed);
+            size_t tail = tail_.load(turf::Relaxed);
+            return tail > head ? tail - head : 0;
+        }
+
+        // consumer side
+        bool empty()
+        {
+            size_t pos = head_.load(turf::Relaxed);
+            if (pos == cached_tail_)
+                cached_tail_ = tail_.load(turf::Acquire);
+            return pos == cached_tail_;
+        }
+
+    private:
+        typedef char                cacheline_pad_t[64];
+
+        cacheline_pad_t             pad0_;
+        T*                          buffer_;
+        size_t                      buffer_mask_;
+        cacheline_pad_t             pad1_;
+        turf::Atomic<size_t>        head_;
+        size_t                      cached_tail_;   // consumer only
+        cacheline_pad_t             pad2_;
+        turf::Atomic<size_t>        tail_;
+        size_t                      cached_head_;   // producer only
+        cacheline_pad_t             pad3_;
+
+        spsc_bounded_queue(spsc_bounded_queue const&);
+        void operator = (spsc_bounded_queue const&);
+    };
+
+    // multi producer, single consumer ring of variable sized records.
+    // producers reserve() and commit() records in place, a padding record fills the
+    // tail when a record does not fit before wrap around. the consumer reads records
+    // in place and gives the space back in bulk with release().
+    class mpsc_byte_ring
+    {
+    public:
+        mpsc_byte_ring()
+            : buffer_(NULL)
+            , buffer_mask_(0)
+            , consume_pos_(0)
+        {}
+
+        ~mpsc_byte_ring()
+        {
+            delete []buffer_;
+        }
+
+        void reset(size_t buffer_size)
+        {
+            assert((buffer_size >= 64) && ((buffer_size & (buffer_size - 1)) == 0));
+
+            delete []buffer_;
+            buffer_ = new uint64_t[buffer_size / sizeof(uint64_t)]();   // zeroed
+            buffer_mask_ = buffer_size - 1;
+            write_pos_.store(0, turf::Relaxed);
+            read_pos_.store(0, turf::Relaxed);
+            consume_pos_ = 0;
+        }
+
+        size_t capacity() const
+        {
+            return buffer_mask_ + 1;
+        }
+
+        // largest size reserve() accepts. a record of at most half the ring always fits once
+        // the consumer catches up, as the padding before it is smaller than the record.
+        size_t max_size() const
+        {
+            return capacity() / 2 - sizeof(header_t);
+        }
+
+        void* reserve(size_t size)
+        {
+            size_t need = (sizeof(header_t) + size + k_align - 1) & ~(k_align - 1);
+            if (need > capacity() / 2)
+                return NULL;
+
+            size_t pos = write_pos_.load(turf::Relaxed);
+            size_t room;
+            size_t total;
+            for (;;)
+            {
+                room = capacity() - (pos & buffer_mask_);
+                total = (room < need) ? room + need : need;
+                if (pos + total - read_pos_.load(turf::Acquire) > capacity())
+                    return NULL;
+                if (write_pos_.compareExchangeWeak(pos, pos + total, turf::Relaxed, turf::Relaxed))
+                    break;
+            }
+
+            if (total != need)
+            {
+                header_t* pad = at(pos);
+                pad->size = (uint32_t)room;
+                pad->state.store(k_padding, turf::Release);
+                pos += room;
+            }
+
+            header_t* hdr = at(pos);
+            hdr->size = (uint32_t)need;
+            return hdr + 1;
+        }
+
+        static void commit(void* data)
+        {
+            header_t* hdr = (header_t*)data - 1;
+            hdr->state.store(k_committed, turf::Release);
+        }
+
+        // shrink a reserved record before commit, the tail becomes padding
+        static void shrink(void* data, size_t size)
+        {
+            header_t* hdr = (header_t*)data - 1;
+            size_t need = (sizeof(header_t) + size + k_align - 1) & ~(k_align - 1);
+            if (need >= hdr->size)
+                return;
+
+            header_t* pad = (header_t*)((char*)hdr + need);
+            pad->size = hdr->size - (uint32_t)need;
+            pad->state.store(k_padding, turf::Release);
+            hdr->size = (uint32_t)need;
+        }
+
+        // give up a reserved record, consumer skips it
+        static void cancel(void* data)
+        {
+            header_t* hdr = (header_t*)data - 1;
+            hdr->state.store(k_padding, turf::Release);
+        }
+
+        // consumer side. NULL if the next record is not committed yet.
+        void* front()
+        {
+            for (;;)
+            {
+                // a full ring wraps onto records consumed but not released yet
+                if (consume_pos_ - read_pos_.load(turf::Relaxed) >= capacity())
+                    return NULL;
+                header_t* hdr = at(consume_pos_);
+                uint32_t state = hdr->state.load(turf::Acquire);
+                if (state == k_padding)
+                    consume_pos_ += hdr->size;
+                else if (state == k_committed)
+                    return hdr + 1;
+                else
+                    return NULL;
+            }
+        }
+
+        void pop_front()
+        {
+            consume_pos_ += at(consume_pos_)->size;
+        }
+
+        // bytes taken by producers and not released yet. racy, for monitoring only.
+        size_t size_approx()
+        {
+            size_t read = read_pos_.load(turf::Relaxed);
+            size_t write = write_pos_.load(turf::Relaxed);
+            return write > read ? write - read : 0;
+        }
+
+        size_t write_pos()
+        {
+            return write_pos_.load(turf::Relaxed);
+        }
+
+        size_t read_pos()
+        {
+            return read_pos_.load(turf::Relaxed);
+        }
+
+        size_t unreleased() const
+        {
+            return consume_pos_ - read_pos_.load(turf::Relaxed);
+        }
+
+        void release()
+        {
+            size_t pos = read_pos_.load(turf::Relaxed);
+            size_t len = consume_pos_ - pos;
+            if (len == 0)
+                return;
+
+            // zero consumed space so stale payload never looks like a committed header
+            char* base = (char*)buffer_;
+            size_t begin = pos & buffer_mask_;
+            size_t first = (len < capacity() - begin) ? len : capacity() - begin;
+            ::memset(base + begin, 0, first);
+            ::memset(base, 0, len - first);
+
+            read_pos_.store(consume_pos_, turf::Release);
+        }
+
+    private:
+        struct header_t
+        {
+            turf::Atomic<uint32_t>  state;
+            uint32_t                size;   // including header and alignment
+        };
+
+        static const size_t         k_align = 8;
+        static const uint32_t       k_committed = 1;
+        static const uint32_t       k_padding = 2;
+
+        header_t* at(size_t pos)
+        {
+            return (header_t*)((char*)buffer_ + (pos & buffer_mask_));
+        }
+
+        typedef char                cacheline_pad_t[64];
+
+        cacheline_pad_t             pad0_;
+        uint64_t*                   buffer_;
+        size_t                      buffer_mask_;
+        cacheline_pad_t             pad1_;
+        turf::Atomic<size_t>        write_pos_;
+        cacheline_pad_t             pad2_;
+        turf::Atomic<size_t>        read_pos_;
+        size_t                      consume_pos_;   // consumer only
+        cacheline_pad_t             pad3_;
+
+        mpsc_byte_ring(mpsc_byte_ring const&);
+        void operator = (mpsc_byte_ring const&);
+    };
+
     template <class T>
     struct MPMCBoundedQueue {
         explicit MPMCBoundedQueue(size_t size) : q(size) {}
@@ -133,7 +533,63 @@ namespace tz { namespace asynclog {
             return this->q.dequeue(obj);
         }
 
+        size_t try_pop_bulk(T *out, size_t max) {
+            return this->q.dequeue_bulk(out, max);
+        }
+
+        // caller must be the only consumer
+        size_t try_pop_bulk_single(T *out, size_t max) {
+            return this->q.dequeue_bulk_single_consumer(out, max);
+        }
+
+        size_t capacity() const {
+            return this->q.capacity();
+        }
+
+        size_t size_approx() {
+            return this->q.size_approx();
+        }
+
+        size_t write_pos() {
+            return this->q.write_pos();
+        }
+
+        size_t read_pos() {
+            return this->q.read_pos();
+        }
+
         mpmc_bounded_queue<T> q;
     };
 
+    template <class T>
+    struct SPSCBoundedQueue {
+        explicit SPSCBoundedQueue(size_t size) : q(size) {}
+
+        bool try_push_back(const T &obj) {
+            return this->q.enqueue(obj);
+        }
+
+        bool try_pop_front(T &obj) {
+            return this->q.dequeue(obj);
+        }
+
+        size_t try_pop_bulk(T *out, size_t max) {
+            return this->q.dequeue_bulk(out, max);
+        }
+
+        bool empty() {
+            return this->q.empty();
+        }
+
+        size_t capacity() const {
+            return this->q.capacity();
+        }
+
+        size_t size_approx() {
+            return this->q.size_approx();
+        }
+
+        spsc_bounded_queue<T> q;
+    };
+
 }}  // ::tz::asynclog
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <string>
+
+#include <turf/Atomic.h>
+
+
+namespace tz { namespace asynclog {
+
+// shared memory segments are named TZ_ASYNCLOG_SHM_PREFIX<pid>.<name> and show up in /dev/shm
+#define TZ_ASYNCLOG_SHM_PREFIX  "asynclog."
+#define TZ_ASYNCLOG_SHM_MAGIC   0x474f4c41u     // "ALOG"
+#define TZ_ASYNCLOG_SHM_VERSION 1
+
+    // stats of one logger, published by its consumer thread. readers check magic and version,
+    // and retry while seq is odd or changed during the read. fields are only ever appended,
+    // size tells how much of the page the writer knows about.
+    struct ShmStatsPage {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;
+        int32_t pid;
+        char name[64];
+
+        turf::Atomic<uint64_t> seq;         // odd while the consumer writes
+        turf::Atomic<uint64_t> update_ns;   // CLOCK_REALTIME of the last publish
+        turf::Atomic<uint64_t> stopped;     // consumer exited
+
+        turf::Atomic<uint64_t> level;
+        turf::Atomic<uint64_t> queue_mode;
+        turf::Atomic<uint64_t> queue_capacity;  // slots, bytes with QUEUE_RING
+        turf::Atomic<uint64_t> queue_depth;
+        turf::Atomic<uint64_t> queue_write_pos; // 0 with QUEUE_SPSC
+        turf::Atomic<uint64_t> queue_read_pos;
+
+        turf::Atomic<uint64_t> total;
+        turf::Atomic<uint64_t> drop;
+        turf::Atomic<uint64_t> err;
+        turf::Atomic<uint64_t> trunc;
+        turf::Atomic<uint64_t> chunked;
+        turf::Atomic<uint64_t> shed;
+        turf::Atomic<uint64_t> coalesced;
+        turf::Atomic<uint64_t> blocked;
+        turf::Atomic<uint64_t> blocked_us;
+        turf::Atomic<uint64_t> block_timeout;
+        turf::Atomic<uint64_t> resize;
+        turf::Atomic<uint64_t> budget_full;
+        turf::Atomic<uint64_t> inflight_bytes;
+        turf::Atomic<uint64_t> inflight_peak;
+        turf::Atomic<uint64_t> pool_bytes;
+        turf::Atomic<uint64_t> write_bytes;
+        turf::Atomic<uint64_t> drop_level[8];   // by LogLevel
+    };
+
+    inline std::string _shm_stats_name(pid_t pid, const std::string &name) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "/" TZ_ASYNCLOG_SHM_PREFIX "%d.", (int)pid);
+        return buf + name;
+    }
+
+    // creates and maps the segment, NULL with errno on error. EEXIST if the name is taken,
+    // the page of another logger is never truncated.
+    inline ShmStatsPage *_shm_stats_create(const std::string &shm_name, const std::string &name) {
+        int fd = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return NULL;
+        }
+        if (::ftruncate(fd, sizeof(ShmStatsPage)) != 0) {
+            int err = errno;
+            ::close(fd);
+            ::shm_unlink(shm_name.c_str());
+            errno = err;
+            return NULL;
+        }
+        void *addr = ::mmap(NULL, sizeof(ShmStatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            ::shm_unlink(shm_name.c_str());
+            errno = err;
+            return NULL;
+        }
+
+        // zero filled by ftruncate
+        ShmStatsPage *page = (ShmStatsPage *)addr;
+        page->version = TZ_ASYNCLOG_SHM_VERSION;
+        page->size = sizeof(ShmStatsPage);
+        page->pid = (int32_t)::getpid();
+        ::strncpy(page->name, name.c_str(), sizeof(page->name) - 1);
+        turf::threadFenceRelease();
+        page->magic = TZ_ASYNCLOG_SHM_MAGIC;     // readers skip the page until this is set
+        return page;
+    }
+
+    inline void _shm_stats_destroy(ShmStatsPage *page, const std::string &shm_name) {
+        ::munmap(page, sizeof(ShmStatsPage));
+        ::shm_unlink(shm_name.c_str());
+    }
+
+}}  // ::tz::asynclog
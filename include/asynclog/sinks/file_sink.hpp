@@ -48,6 +48,10 @@ namespace tz { namespace asynclog {
         }
 
         virtual bool sink(LogMsg *msg) {
+            return this->sink_batch(&msg, 1);
+        }
+
+        virtual bool sink_batch(LogMsg **msgs, size_t n) {
             bool ok = true;
             if (this->fd < 0) {
                 if (!this->reload()) {
@@ -58,18 +62,36 @@ namespace tz { namespace asynclog {
             }
 
             {
+                bool timed = this->logger->metrics_enabled;
+                uint64_t begin_ns = timed ? _get_clock_nsec(CLOCK_MONOTONIC) : 0;
+
+                // format the whole batch, then write it at once
                 std::string &buf = this->fmtbuf;
                 buf.clear();
-                this->format(buf, msg);
-                buf.push_back('\n');
+                size_t longest = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    size_t begin = buf.size();
+                    this->format(buf, msgs[i]);
+                    buf.push_back('\n');
+                    longest = buf.size() - begin > longest ? buf.size() - begin : longest;
+                }
 
-                if (!this->_write(buf.data(), buf.size())) {
+                uint64_t format_ns = timed ? _get_clock_nsec(CLOCK_MONOTONIC) : 0;
+                bool written = this->_write(buf.data(), buf.size());
+                if (timed) {
+                    uint64_t write_ns = _get_clock_nsec(CLOCK_MONOTONIC);
+                    this->logger->record_format(format_ns - begin_ns, write_ns - format_ns, written ? buf.size() : 0);
+                }
+                if (longest > 16 * k_buf_size) {
+                    std::string().swap(buf);    // do not hold memory of a long msg, full batches keep it
+                }
+                if (!written) {
                     goto L_RETURN;
                 }
             }
 
         L_RETURN:
-            this->logger->recycle(msg);
+            this->logger->recycle_batch(msgs, n);
             return ok;
         }
 
@@ -81,11 +103,18 @@ namespace tz { namespace asynclog {
             }
 
             if (size >= k_buf_size) {
-                // log too long, write without go through buffer
-                ssize_t rv = ::write(this->fd, data, size);
-                if (rv != (ssize_t)size) {
-                    this->logger->_internal_log(ALOG_LVL_FATAL, "write() error [fd:%d][errno:%d]", this->fd, errno);
-                    return false;
+                // log too long, write without go through buffer. joined long msgs end up here.
+                while (size > 0) {
+                    ssize_t rv = ::write(this->fd, data, size);
+                    if (rv < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (rv <= 0) {
+                        this->logger->_internal_log(ALOG_LVL_FATAL, "write() error [fd:%d][errno:%d]", this->fd, errno);
+                        return false;
+                    }
+                    data += rv;
+                    size -= (size_t)rv;
                 }
             } else {
                 // append log to buffer
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <errno.h>
 #include <string>
 
 #include "fmt_sink.hpp"
@@ -14,17 +15,32 @@ namespace tz { namespace asynclog {
         {}
 
         virtual bool sink(LogMsg *msg) {
-            std::string buf;
-            this->format(buf, msg);
-            buf.push_back('\n');
+            return this->sink_batch(&msg, 1);
+        }
+
+        virtual bool sink_batch(LogMsg **msgs, size_t count) {
+            bool timed = this->logger->metrics_enabled;
+            uint64_t begin_ns = timed ? _get_clock_nsec(CLOCK_MONOTONIC) : 0;
 
+            std::string &buf = this->fmtbuf;
+            buf.clear();
+            for (size_t i = 0; i < count; ++i) {
+                this->format(buf, msgs[i]);
+                buf.push_back('\n');
+            }
+
+            uint64_t format_ns = timed ? _get_clock_nsec(CLOCK_MONOTONIC) : 0;
             size_t n = fwrite(buf.data(), 1, buf.size(), this->fp);
             if (n != buf.size()) {
                 this->logger->_internal_log(ALOG_LVL_FATAL,
                     "fwrite() error [size:%zu][writen:%zu][errno:%d]", buf.size(), n, errno);
             }
+            if (timed) {
+                uint64_t write_ns = _get_clock_nsec(CLOCK_MONOTONIC);
+                this->logger->record_format(format_ns - begin_ns, write_ns - format_ns, n);
+            }
 
-            this->logger->recycle(msg);
+            this->logger->recycle_batch(msgs, count);
             return true;
         }
 
@@ -41,6 +57,7 @@ namespace tz { namespace asynclog {
 
         // private
         FILE *fp;
+        std::string fmtbuf;
     };
 
 }}  // ::tz::asynclog
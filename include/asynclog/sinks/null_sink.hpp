@@ -13,6 +13,11 @@ namespace tz { namespace asynclog {
             return true;
         }
 
+        virtual bool sink_batch(LogMsg **msgs, size_t n) {
+            this->logger->recycle_batch(msgs, n);
+            return true;
+        }
+
         virtual void flush() {}
         virtual void close() {}
     };
@@ -0,0 +1,254 @@
+// asynclog-top: shows stats of running loggers published with AsyncLogger::set_shm_stats()
+
+// system
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+// proj
+#include "asynclog/shm_stats.hpp"
+
+
+using namespace std;
+using namespace tz::asynclog;
+
+
+struct Args {
+    double interval;
+    size_t iterations;  // 0 for forever
+    bool all;
+    string name;        // substring filter
+};
+
+// plain copy of a page
+struct Sample {
+    string shm_name;
+    int pid;
+    string name;
+    bool alive;
+    uint64_t update_ns;
+    uint64_t stopped;
+    uint64_t queue_mode;
+    uint64_t queue_capacity;
+    uint64_t queue_depth;
+    uint64_t total;
+    uint64_t drop;
+    uint64_t shed;
+    uint64_t blocked;
+    uint64_t inflight_bytes;
+    uint64_t write_bytes;
+};
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-i seconds] [-n iterations] [-a] [name]\n"
+        "  -i, --interval   seconds between updates, default 1\n"
+        "  -n, --count      number of updates, default forever\n"
+        "  -a, --all        also show pages of exited processes\n",
+        prog);
+}
+
+static Args parse_args(int argc, char **argv) {
+    Args args;
+    args.interval = 1.0;
+    args.iterations = 0;
+    args.all = false;
+
+    struct option long_options[] = {
+        {"interval",    required_argument, 0, 'i'},
+        {"count",       required_argument, 0, 'n'},
+        {"all",         no_argument,       0, 'a'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while (true) {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "i:n:ah", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'i':
+            args.interval = atof(optarg);
+            if (args.interval <= 0) {
+                args.interval = 1.0;
+            }
+            break;
+        case 'n':
+            args.iterations = (size_t)atol(optarg);
+            break;
+        case 'a':
+            args.all = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (optind < argc) {
+        args.name = argv[optind];
+    }
+    return args;
+}
+
+// false if the page is not ours or the writer keeps racing
+static bool read_page(const string &shm_name, Sample &out) {
+    int fd = ::shm_open(shm_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmStatsPage)) {
+        ::close(fd);
+        return false;
+    }
+    void *addr = ::mmap(NULL, sizeof(ShmStatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    const ShmStatsPage *page = (const ShmStatsPage *)addr;
+    bool ok = false;
+    // newer writers only append fields, any version with our fields will do
+    if (page->magic == TZ_ASYNCLOG_SHM_MAGIC && page->version >= 1 && page->size >= sizeof(ShmStatsPage))
+    {
+        turf::threadFenceAcquire();
+        ShmStatsPage *p = const_cast<ShmStatsPage *>(page);    // turf loads are not const
+        for (int attempt = 0; attempt < 100 && !ok; ++attempt) {
+            uint64_t seq = p->seq.load(turf::Acquire);
+            if (seq & 1) {
+                sched_yield();
+                continue;
+            }
+            out.update_ns = p->update_ns.load(turf::Relaxed);
+            out.stopped = p->stopped.load(turf::Relaxed);
+            out.queue_mode = p->queue_mode.load(turf::Relaxed);
+            out.queue_capacity = p->queue_capacity.load(turf::Relaxed);
+            out.queue_depth = p->queue_depth.load(turf::Relaxed);
+            out.total = p->total.load(turf::Relaxed);
+            out.drop = p->drop.load(turf::Relaxed);
+            out.shed = p->shed.load(turf::Relaxed);
+            out.blocked = p->blocked.load(turf::Relaxed);
+            out.inflight_bytes = p->inflight_bytes.load(turf::Relaxed);
+            out.write_bytes = p->write_bytes.load(turf::Relaxed);
+            turf::threadFenceAcquire();
+            ok = p->seq.load(turf::Relaxed) == seq;
+        }
+        if (ok) {
+            out.shm_name = shm_name;
+            out.pid = page->pid;
+            out.name.assign(page->name, strnlen(page->name, sizeof(page->name)));
+            out.alive = ::kill(page->pid, 0) == 0 || errno == EPERM;
+        }
+    }
+    ::munmap(addr, sizeof(ShmStatsPage));
+    return ok;
+}
+
+static void read_all(const Args &args, vector<Sample> &samples) {
+    samples.clear();
+    DIR *dir = ::opendir("/dev/shm");
+    if (dir == NULL) {
+        return;
+    }
+    const size_t prefix_len = strlen(TZ_ASYNCLOG_SHM_PREFIX);
+    while (struct dirent *ent = ::readdir(dir)) {
+        if (strncmp(ent->d_name, TZ_ASYNCLOG_SHM_PREFIX, prefix_len) != 0) {
+            continue;
+        }
+        Sample s;
+        if (!read_page(string("/") + ent->d_name, s)) {
+            continue;
+        }
+        if (!args.all && !s.alive) {
+            continue;
+        }
+        if (!args.name.empty() && s.name.find(args.name) == string::npos) {
+            continue;
+        }
+        samples.push_back(s);
+    }
+    ::closedir(dir);
+}
+
+static const Sample *find_prev(const vector<Sample> &prev, const Sample &s) {
+    for (size_t i = 0; i < prev.size(); ++i) {
+        if (prev[i].shm_name == s.shm_name) {
+            return &prev[i];
+        }
+    }
+    return NULL;
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+    return now > before ? (now - before) / seconds : 0.0;
+}
+
+static const char *mode_name(uint64_t mode) {
+    switch (mode) {
+    case 0:     return "mpmc";
+    case 1:     return "spsc";
+    case 2:     return "ring";
+    default:    return "?";
+    }
+}
+
+static void print(const vector<Sample> &prev, const vector<Sample> &cur, double seconds) {
+    printf("%-8s %-20s %-5s %10s %10s %10s %12s %12s %16s %6s %12s %s\n",
+        "PID", "NAME", "QUEUE", "MSG/s", "DROP/s", "KB/s", "TOTAL", "DROP", "DEPTH/CAP", "FILL%",
+        "INFLIGHT", "STATE");
+    for (size_t i = 0; i < cur.size(); ++i) {
+        const Sample &s = cur[i];
+        const Sample *p = find_prev(prev, s);
+        // the consumer publishes every flush interval, prefer its own timestamps
+        double secs = seconds;
+        if (p != NULL && s.update_ns > p->update_ns) {
+            secs = (s.update_ns - p->update_ns) / 1e9;
+        }
+        double msgs = p ? rate(s.total, p->total, secs) : 0.0;
+        double drops = p ? rate(s.drop, p->drop, secs) : 0.0;
+        double kbytes = p ? rate(s.write_bytes, p->write_bytes, secs) / 1024 : 0.0;
+        char depth[32];
+        snprintf(depth, sizeof(depth), "%lu/%lu", (unsigned long)s.queue_depth, (unsigned long)s.queue_capacity);
+        double fill = s.queue_capacity ? 100.0 * s.queue_depth / s.queue_capacity : 0.0;
+        const char *state = !s.alive ? "dead" : (s.stopped ? "stopped" : "running");
+        printf("%-8d %-20s %-5s %10.0f %10.0f %10.1f %12lu %12lu %16s %6.1f %12lu %s\n",
+            s.pid, s.name.c_str(), mode_name(s.queue_mode), msgs, drops, kbytes,
+            (unsigned long)s.total, (unsigned long)s.drop, depth, fill,
+            (unsigned long)s.inflight_bytes, state);
+    }
+    if (cur.empty()) {
+        printf("no loggers found in /dev/shm\n");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+int main(int argc, char **argv) {
+    Args args = parse_args(argc, argv);
+
+    timespec ts;
+    ts.tv_sec = (time_t)args.interval;
+    ts.tv_nsec = (long)((args.interval - ts.tv_sec) * 1e9);
+
+    vector<Sample> prev;
+    vector<Sample> cur;
+    read_all(args, prev);
+    for (size_t i = 0; args.iterations == 0 || i < args.iterations; ++i) {
+        ::nanosleep(&ts, NULL);
+        read_all(args, cur);
+        print(prev, cur, args.interval);
+        prev.swap(cur);
+    }
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include "asynclog/sinks/null_sink.hpp"
 #include "asynclog/sinks/fp_sink.hpp"
 #include "asynclog/sinks/file_sink.hpp"
+#include "asynclog/exporters/prometheus_exporter.hpp"
 
 
 using namespace std;
@@ -19,6 +20,7 @@ using namespace tz::asynclog;
 
 static tz::asynclog::AsyncLogger logger(1024 * 1024);
 static tz::asynclog::AsyncLogger debugger(1024 * 1024);
+static size_t error_every = 0;      // every nth msg is an error, 0 for none
 
 
 static uint64_t get_time_usec() {
@@ -32,6 +34,10 @@ void producer(boost::mutex *start, size_t id, size_t count) {
     start->lock();
     uint64_t producer_begin_us = get_time_usec();
     for (size_t i = 0; i < count; ++i) {
+        if (error_every != 0 && i % error_every == 0) {
+            TZ_ASYNC_LOG(logger, ALOG_LVL_ERROR, "asynclog error (%zu, %zu) : This is some text for your pleasure", id, i);
+            continue;
+        }
         TZ_ASYNC_LOG(logger, ALOG_LVL_DEBUG, "asynclog message (%zu, %zu) : This is some text for your pleasure", id, i);
     }
     uint64_t producer_done_us = get_time_usec();
@@ -46,6 +52,21 @@ struct Args {
     size_t producer;
     size_t works;
     string sink;
+    string queue;
+    size_t batch;
+    string wait;
+    string overflow;
+    string format;
+    string clock;
+    size_t errors;
+    size_t prio;
+    string shed;
+    size_t resize;
+    size_t budget;
+    bool metrics;
+    string prom;
+    string shm;
+    size_t sites;
 };
 
 
@@ -53,18 +74,45 @@ Args parse_arge(int argc, char **argv) {
     Args args;
     args.producer = 1;
     args.works = 10 * 1000 * 1000;
+    args.queue = "mpmc";
+    args.batch = 64;
+    args.wait = "sleep";
+    args.overflow = "drop";
+    args.format = "eager";
+    args.clock = "realtime";
+    args.errors = 0;
+    args.prio = 0;
+    args.resize = 0;
+    args.budget = 0;
+    args.metrics = false;
+    args.sites = 0;
 
     struct option long_options[] = {
         {"producer",    required_argument, 0, 'p'},
         {"work",        required_argument, 0, 'n'},
         {"sink",        required_argument, 0, 's'},
+        {"queue",       required_argument, 0, 'q'},
+        {"batch",       required_argument, 0, 'b'},
+        {"wait",        required_argument, 0, 'w'},
+        {"overflow",    required_argument, 0, 'o'},
+        {"format",      required_argument, 0, 'f'},
+        {"clock",       required_argument, 0, 'c'},
+        {"errors",      required_argument, 0, 'e'},
+        {"prio",        required_argument, 0, 'P'},
+        {"shed",        required_argument, 0, 'S'},
+        {"resize",      required_argument, 0, 'r'},
+        {"budget",      required_argument, 0, 'B'},
+        {"metrics",     no_argument,       0, 'M'},
+        {"prom",        required_argument, 0, 'x'},
+        {"shm",         required_argument, 0, 'H'},
+        {"sites",       required_argument, 0, 't'},
         {0, 0, 0, 0}
     };
 
     while (true) {
         /* getopt_long stores the option index here. */
         int option_index = 0;
-        int c = getopt_long (argc, argv, "p:n:s:m:",
+        int c = getopt_long (argc, argv, "p:n:s:m:q:b:w:o:f:c:e:P:S:r:B:Mx:H:t:",
             long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -83,6 +131,51 @@ Args parse_arge(int argc, char **argv) {
         case 's':
             args.sink = optarg;
             break;
+        case 'q':
+            args.queue = optarg;
+            break;
+        case 'b':
+            args.batch = (size_t)atol(optarg);
+            break;
+        case 'w':
+            args.wait = optarg;
+            break;
+        case 'o':
+            args.overflow = optarg;
+            break;
+        case 'f':
+            args.format = optarg;
+            break;
+        case 'c':
+            args.clock = optarg;
+            break;
+        case 'e':
+            args.errors = (size_t)atol(optarg);
+            break;
+        case 'P':
+            args.prio = (size_t)atol(optarg);
+            break;
+        case 'S':
+            args.shed = optarg;
+            break;
+        case 'r':
+            args.resize = (size_t)atol(optarg);
+            break;
+        case 'B':
+            args.budget = (size_t)atol(optarg);
+            break;
+        case 'M':
+            args.metrics = true;
+            break;
+        case 'x':
+            args.prom = optarg;
+            break;
+        case 'H':
+            args.shm = optarg;
+            break;
+        case 't':
+            args.sites = (size_t)atol(optarg);
+            break;
         case '?':
             /* getopt_long already printed an error message. */
             break;
@@ -100,8 +193,76 @@ int main(int argc, char **argv) {
     debugger.start();
     
     Args args = parse_arge(argc, argv);
-    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[producer:%zu][works:%zu][sink:%s]",
-        args.producer, args.works, args.sink.c_str());
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[producer:%zu][works:%zu][sink:%s][queue:%s][batch:%zu]",
+        args.producer, args.works, args.sink.c_str(), args.queue.c_str(), args.batch);
+
+    logger.batch_size = (uint32_t)args.batch;
+    if (args.wait == "park") {
+        logger.set_wait_mode(WAIT_PARK);
+    }
+    if (args.format == "deferred") {
+        logger.set_deferred_format(true);
+    }
+    if (args.overflow == "block") {
+        logger.set_overflow_policy(OVERFLOW_BLOCK);
+    } else if (args.overflow.compare(0, 6, "block:") == 0) {
+        logger.set_overflow_policy(OVERFLOW_BLOCK_TIMEOUT, (uint32_t)atol(args.overflow.c_str() + 6));
+    }
+
+    if (args.clock == "coarse") {
+        logger.set_clock_source(CLOCKSRC_COARSE);
+    } else if (args.clock == "tsc") {
+        logger.set_clock_source(CLOCKSRC_TSC);
+    } else if (args.clock == "ticker") {
+        logger.set_clock_source(CLOCKSRC_TICKER);
+    } else if (args.clock != "realtime") {
+        cerr << "unknown clock: " << args.clock << endl;
+        return 1;
+    }
+
+    error_every = args.errors;
+    if (args.prio != 0) {
+        logger.set_priority_lane(ALOG_LVL_ERROR, args.prio);
+    }
+
+    if (!args.shed.empty()) {
+        // sample_pct:sample_every:drop_pct
+        unsigned sample_pct = 0, sample_every = 0, drop_pct = 0;
+        if (sscanf(args.shed.c_str(), "%u:%u:%u", &sample_pct, &sample_every, &drop_pct) != 3) {
+            cerr << "bad shed ladder: " << args.shed << endl;
+            return 1;
+        }
+        logger.set_shedding((uint8_t)sample_pct, sample_every, (uint8_t)drop_pct);
+    }
+
+    if (args.resize != 0 && (args.resize < 2 || (args.resize & (args.resize - 1)) != 0)) {
+        cerr << "resize is not a power of 2: " << args.resize << endl;
+        return 1;
+    }
+
+    logger.set_byte_budget(args.budget);
+    logger.set_metrics(args.metrics);
+    if (!args.prom.empty()) {
+        logger.set_metrics_exporter(IMetricsExporter::Ptr(new PrometheusFileExporter(args.prom, "bench")), 1000);
+        args.metrics = true;
+    }
+    if (!args.shm.empty()) {
+        logger.set_shm_stats(args.shm);
+    }
+    if (args.sites != 0) {
+        logger.set_site_stats(true, 1000, args.sites);
+    }
+
+    if (args.queue == "spsc") {
+        logger.set_queue_mode(QUEUE_SPSC);
+    } else if (args.queue == "ring") {
+        logger.set_queue_mode(QUEUE_RING);
+    } else if (args.queue == "malloc") {
+        logger.set_use_pool(false);
+    } else if (args.queue != "mpmc") {
+        cerr << "unknown queue: " << args.queue << endl;
+        return 1;
+    }
 
     if (args.sink.empty()) {
         logger.set_sink(ILogSink::Ptr(new NullSink));
@@ -113,6 +274,19 @@ int main(int argc, char **argv) {
     }
     logger.start();
 
+    // cost of stamping a msg with the chosen clock
+    {
+        const size_t k_stamps = 1000 * 1000;
+        LogMsg msg;
+        uint64_t begin_us = get_time_usec();
+        for (size_t i = 0; i < k_stamps; ++i) {
+            logger._stamp(&msg);
+        }
+        uint64_t stamp_us = get_time_usec() - begin_us;
+        TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[clock:%s][stamp_ns:%.1f]",
+            args.clock.c_str(), 1000.0 * stamp_us / k_stamps);
+    }
+
     // prepare threads
     boost::mutex signals[args.producer];
     for (size_t id = 0; id < args.producer; ++id) {
@@ -132,6 +306,10 @@ int main(int argc, char **argv) {
     for (size_t id = 0; id < args.producer; ++id) {
         signals[id].unlock();
     }
+    if (args.resize != 0) {
+        // under load
+        logger.set_queue_size(args.resize);
+    }
 
     // wait for producer
     for (size_t id = 0; id < args.producer; ++id) {
@@ -146,14 +324,45 @@ int main(int argc, char **argv) {
     uint64_t consumer_duration = consumer_done_us - start_us;
 
     TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO,
-        "[producers:%zu][works:%zu][prod_us:%lu][cons_us:%lu]",
-        args.producer, args.works, producer_done_us - start_us, consumer_done_us - start_us);
+        "[producers:%zu][works:%zu][queue:%s][format:%s][clock:%s][prod_us:%lu][cons_us:%lu][ns_per_call:%.1f]",
+        args.producer, args.works, args.queue.c_str(), args.format.c_str(), args.clock.c_str(),
+        producer_done_us - start_us, consumer_done_us - start_us,
+        1000.0 * (producer_done_us - start_us) / args.works);
     uint64_t total = logger.stats.total.load(turf::Relaxed);
     uint64_t drop = logger.stats.drop.load(turf::Relaxed);
     double drop_rate = (double)drop / total;
     double consumer_qps = 1000000.0 * (total - drop) / consumer_duration;
     TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[total:%zu][drop:%zu][drop_rate:%g][cons_qps:%.2f]",
         total, drop, drop_rate, consumer_qps);
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[prio:%zu][drop_debug:%lu][drop_error:%lu][shed:%lu][resize:%lu]",
+        args.prio, logger.stats.drop_level[ALOG_LVL_DEBUG].load(turf::Relaxed),
+        logger.stats.drop_level[ALOG_LVL_ERROR].load(turf::Relaxed),
+        logger.stats.shed.load(turf::Relaxed), logger.stats.resize.load(turf::Relaxed));
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[budget:%zu][inflight_bytes:%lu][inflight_peak:%lu][budget_full:%lu]",
+        args.budget, logger.stats.inflight_bytes.load(turf::Relaxed),
+        logger.stats.inflight_peak.load(turf::Relaxed), logger.stats.budget_full.load(turf::Relaxed));
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[pool_bytes:%lu][pool_inuse:%lu][pool_large:%lu]",
+        logger.stats.pool_bytes.load(turf::Relaxed), logger.stats.pool_inuse.load(turf::Relaxed),
+        logger.stats.pool_large.load(turf::Relaxed));
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[blocked:%lu][blocked_us:%lu][block_timeout:%lu]",
+        logger.stats.blocked.load(turf::Relaxed), logger.stats.blocked_us.load(turf::Relaxed),
+        logger.stats.block_timeout.load(turf::Relaxed));
+    if (args.metrics) {
+        MetricsSnapshot snap;
+        logger.get_metrics(snap);
+        TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO,
+            "[latency_avg_us:%.1f][p50_us:%.1f][p99_us:%.1f][p999_us:%.1f][depth_hwm:%lu][depth_hwm_last:%lu]",
+            snap.latency_count ? snap.latency_sum_ns / 1000.0 / snap.latency_count : 0.0,
+            snap.latency_quantile(0.5) / 1000.0, snap.latency_quantile(0.99) / 1000.0,
+            snap.latency_quantile(0.999) / 1000.0, snap.depth_hwm, snap.depth_hwm_last);
+        TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO,
+            "[sink_us:%lu][format_us:%lu][write_us:%lu][write_bytes:%lu][flush_us:%lu]",
+            snap.sink_ns / 1000, snap.format_ns / 1000, snap.write_ns / 1000, snap.write_bytes,
+            snap.flush_ns / 1000);
+    }
+    if (args.sites != 0) {
+        dump_log_sites(stdout, args.sites);
+    }
 
     return 0;
 }
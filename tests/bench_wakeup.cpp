@@ -0,0 +1,154 @@
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <iostream>
+
+#include "asynclog/asynclog.hpp"
+#include "asynclog/sinks/fp_sink.hpp"
+
+
+using namespace std;
+using namespace tz::asynclog;
+
+
+// measures idle cpu usage of the consumer and latency of the first msg after a quiet period
+
+
+static tz::asynclog::AsyncLogger logger(1024);
+static tz::asynclog::AsyncLogger debugger(1024);
+
+
+static uint64_t get_time_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t get_cpu_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+
+struct LatencySink : ILogSink {
+    LatencySink() : count(0), sum_us(0), max_us(0) {}
+
+    virtual bool sink(LogMsg *msg) {
+        uint64_t now = get_time_usec();
+        uint64_t sent = msg->time_ns / 1000;
+        uint64_t latency = now > sent ? now - sent : 0;
+        this->count++;
+        this->sum_us += latency;
+        if (latency > this->max_us) {
+            this->max_us = latency;
+        }
+        this->logger->recycle(msg);
+        return true;
+    }
+
+    virtual void flush() {}
+    virtual void close() {}
+
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+};
+
+
+struct Args {
+    string wait;
+    size_t count;
+    size_t idle_ms;
+    size_t spin;
+};
+
+
+Args parse_arge(int argc, char **argv) {
+    Args args;
+    args.wait = "sleep";
+    args.count = 50;
+    args.idle_ms = 50;
+    args.spin = 10;
+
+    struct option long_options[] = {
+        {"wait",        required_argument, 0, 'w'},
+        {"count",       required_argument, 0, 'n'},
+        {"idle",        required_argument, 0, 'i'},
+        {"spin",        required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+
+    while (true) {
+        int option_index = 0;
+        int c = getopt_long (argc, argv, "w:n:i:s:",
+            long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 0:
+            break;
+        case 'w':
+            args.wait = optarg;
+            break;
+        case 'n':
+            args.count = (size_t)atol(optarg);
+            break;
+        case 'i':
+            args.idle_ms = (size_t)atol(optarg);
+            break;
+        case 's':
+            args.spin = (size_t)atol(optarg);
+            break;
+        case '?':
+            break;
+        default:
+            abort();
+        }
+    }
+
+    return args;
+}
+
+
+int main(int argc, char **argv) {
+    debugger.set_sink(ILogSink::Ptr(new FpSink(stdout)));
+    debugger.start();
+
+    Args args = parse_arge(argc, argv);
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO, "[wait:%s][count:%zu][idle_ms:%zu][spin:%zu]",
+        args.wait.c_str(), args.count, args.idle_ms, args.spin);
+
+    if (args.wait == "park") {
+        logger.set_wait_mode(WAIT_PARK);
+    } else if (args.wait != "sleep") {
+        cerr << "unknown wait mode: " << args.wait << endl;
+        return 1;
+    }
+    logger.spin_count = (uint32_t)args.spin;
+
+    LatencySink *sink = new LatencySink;
+    logger.set_sink(ILogSink::Ptr(sink));
+    logger.start();
+
+    uint64_t start_us = get_time_usec();
+    uint64_t start_cpu_us = get_cpu_usec();
+    for (size_t i = 0; i < args.count; ++i) {
+        timespec ts = {0, (long)args.idle_ms * 1000 * 1000};
+        ::nanosleep(&ts, NULL);
+        TZ_ASYNC_LOG(logger, ALOG_LVL_INFO, "wakeup %zu", i);
+    }
+    logger.stop();
+    uint64_t wall_us = get_time_usec() - start_us;
+    uint64_t cpu_us = get_cpu_usec() - start_cpu_us;
+
+    TZ_ASYNC_LOG(debugger, ALOG_LVL_INFO,
+        "[wait:%s][msgs:%lu][avg_latency_us:%.1f][max_latency_us:%lu][cpu_us:%lu][wall_us:%lu][cpu_pct:%.3f]",
+        args.wait.c_str(), sink->count, sink->count ? (double)sink->sum_us / sink->count : 0.0,
+        sink->max_us, cpu_us, wall_us, 100.0 * cpu_us / wall_us);
+
+    return 0;
+}
@@ -28,7 +28,7 @@ void thread() {
 void thread_file() {
     for (size_t i = 0; i < 1000; ++i) {
         if (i % 100 == 0) {
-            // test log truncation
+            // test long log, split into chunks and joined
             std::string rep = "1234";
             for (size_t j = 0; j < 10; ++j) {
                 rep += rep;
@@ -45,6 +45,7 @@ void thread_file() {
 
 int main() {
     logger.set_sink(ILogSink::Ptr(new FpSink(stdout)));
+    logger.set_coalesce(200);
     logger.start();
     file_logger.set_sink(ILogSink::Ptr(new FileSink("asynclog_sample.log")));
     file_logger.start();
@@ -60,7 +61,7 @@ int main() {
     int rv = ::nanosleep(&ts, NULL);
     TZ_ASYNC_LOG(logger, ALOG_LVL_DEBUG, "rv: %d", rv);
 
-    // test log truncation
+    // test long log, split into chunks and joined
     std::string rep = "1234";
     for (size_t i = 0; i < 10; ++i) {
         rep += rep;
@@ -70,6 +71,19 @@ int main() {
 
     TZ_ASYNC_LOG(file_logger, ALOG_LVL_DEBUG, "test log to file %d", 123);
 
+    // 5 msgs at once, then 10 per second
+    for (size_t i = 0; i < 100; ++i) {
+        TZ_ASYNC_LOG_RATELIMITED(logger, ALOG_LVL_WARN, 10, 5, "rate limited %zu", i);
+        timespec pause = {0, 2 * 1000 * 1000};  // 2ms
+        ::nanosleep(&pause, NULL);
+    }
+
+    // written once, then "last message repeated 9 times"
+    for (size_t i = 0; i < 10; ++i) {
+        TZ_ASYNC_LOG(logger, ALOG_LVL_ERROR, "flapping %s", "error");
+    }
+    TZ_ASYNC_LOG(logger, ALOG_LVL_INFO, "flapping stopped");
+
     logger.set_level(ALOG_LVL_INFO);
     TZ_ASYNC_LOG(logger, ALOG_LVL_DEBUG, "should not see this");
 
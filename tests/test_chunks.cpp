@@ -0,0 +1,91 @@
+// long msgs are split into chunks by producers and joined by the consumer, check they come out whole
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "asynclog/asynclog.hpp"
+
+
+using namespace tz::asynclog;
+
+
+struct Line {
+    LevelType level;
+    std::string data;
+};
+
+// keeps what it is given, the first call is slow so msgs pile up behind it
+struct RecordSink : ILogSink {
+    RecordSink() : calls(0) {}
+
+    virtual bool sink(LogMsg *msg) {
+        if (this->calls++ == 0) {
+            timespec ts = {0, 200 * 1000 * 1000};   // 200ms
+            ::nanosleep(&ts, NULL);
+        }
+        Line line;
+        line.level = msg->level;
+        line.data.assign(msg->msg_data, msg->msg_size);
+        this->lines.push_back(line);
+        this->logger->recycle(msg);
+        return true;
+    }
+
+    virtual void flush() {}
+    virtual void close() {}
+
+    size_t calls;
+    std::vector<Line> lines;
+};
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failed; \
+        } \
+    } while (0)
+
+
+// a priority msg of a thread popped ahead of the rest of its chunked msg must not cut it
+static void test_priority_lane_interleave() {
+    AsyncLogger logger(1024);
+    RecordSink *sink = new RecordSink();
+    logger.set_sink(ILogSink::Ptr(sink));
+    logger.set_priority_lane(ALOG_LVL_ERROR, 64);
+    logger.batch_size = 2;
+
+    // the first batch is the short msg and the first chunk, the consumer sleeps in the sink with them
+    std::string big = "A" + std::string(4998, 'x') + "Z";
+    logger.log(ALOG_LVL_INFO, "warm up");
+    logger.log(ALOG_LVL_INFO, "%s", big.c_str());
+    logger.start();
+    timespec ts = {0, 50 * 1000 * 1000};    // 50ms
+    ::nanosleep(&ts, NULL);
+    // popped ahead of the remaining chunks
+    logger.log(ALOG_LVL_ERROR, "error");
+    logger.stop();
+
+    CHECK(sink->lines.size() == 3);
+    size_t whole = 0;
+    for (size_t i = 0; i < sink->lines.size(); ++i) {
+        whole += sink->lines[i].data == big;
+    }
+    CHECK(whole == 1);
+    CHECK(logger.stats.chunked.load(turf::Relaxed) == 1);
+    CHECK(logger.stats.trunc.load(turf::Relaxed) == 0);
+    CHECK(logger.stats.drop.load(turf::Relaxed) == 0);
+}
+
+
+int main() {
+    test_priority_lane_interleave();
+    if (failed != 0) {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}